@@ -1,5 +1,8 @@
 #pragma once
 
+#include <cstdint>
+#include <type_traits>
+
 #include "globals.h"
 
 namespace elsar {
@@ -47,4 +50,33 @@ class Embedding {
     return converted_key < other.converted_key;
   }
 };
+
+// The compact entry sorted in memory in place of a record. It carries the
+// normalized key along with the index of the record in the partition buffer,
+// so that moving it around copies 16 plain bytes. The converted prefix and the
+// remaining key bytes (up to two) together order the entries exactly as their
+// keys, so the sort never needs to look at the records themselves.
+#pragma pack(push, 4)
+struct sort_entry {
+  converted_t converted_key;
+  uint32_t record_idx;
+  uint16_t key_suffix;
+
+  bool operator<(const sort_entry &other) const noexcept {
+    return converted_key < other.converted_key or
+           (converted_key == other.converted_key and
+            key_suffix < other.key_suffix);
+  }
+
+  // Whether both entries have the same key
+  bool same_key(const sort_entry &other) const noexcept {
+    return converted_key == other.converted_key and
+           key_suffix == other.key_suffix;
+  }
+};
+#pragma pack(pop)
+
+static_assert(std::is_trivially_copyable<sort_entry>::value,
+              "sort entries must be movable with plain memory copies");
+static_assert(sizeof(sort_entry) == 16, "sort entries must stay compact");
 }  // namespace elsar
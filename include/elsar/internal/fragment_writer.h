@@ -0,0 +1,162 @@
+#pragma once
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#include "globals.h"
+#include "io.h"
+
+using namespace std;
+
+namespace elsar {
+namespace internal {
+
+// A run of records of one partition within a reader's spill file
+struct spill_extent {
+  int partition;
+  size_t offset; /* bytes */
+  size_t length; /* bytes, including the padding of direct I/O */
+};
+
+// The records of a partition spilled by one writer. Its extents, taken in
+// order, hold the `num_recs` records back to back.
+struct spilled_fragment {
+  int fd;
+  size_t num_recs;
+  vector<spill_extent> extents;
+};
+
+// A partition waiting on disk to be sorted, along with where its records go in
+// the output file
+struct spilled_partition {
+  size_t size = 0;         /* records */
+  size_t write_offset = 0; /* bytes */
+  vector<spilled_fragment> fragments;
+  bool in_order = false; /* all its records share the same key */
+};
+
+// Scatters the records of a reader into per-partition staging buffers and
+// appends each buffer to the reader's spill file with a single large write
+// once it fills up. Every write is recorded as an extent, so that the sorters
+// can later gather the records of a partition with positioned reads. The
+// extents of a partition, taken in order, hold its records back to back.
+//
+// Buffers handed to the I/O queue are replaced by spare ones from a pool, so
+// that io_uring writes can proceed while the reader keeps scattering. The pool
+// is only replenished by draining the queue once it runs dry.
+class FragmentWriter {
+ public:
+  FragmentWriter(int spill_fd, vector<spill_extent> &extents,
+                 size_t *frag_sizes, int num_partitions, size_t staging_bytes,
+                 IOQueue &io, bool direct)
+      : spill_fd(spill_fd),
+        extents(extents),
+        frag_sizes(frag_sizes),
+        num_partitions(num_partitions),
+        staging_bytes(staging_bytes),
+        io(io),
+        direct(direct),
+        bufs(num_partitions),
+        buf_fills(num_partitions, 0) {
+    const size_t num_spare_bufs = io.uses_io_uring() ? IO_QUEUE_DEPTH : 0;
+    slab = _alloc_aligned((num_partitions + num_spare_bufs) * staging_bytes);
+    for (int partition_idx = 0; partition_idx < num_partitions;
+         ++partition_idx) {
+      bufs[partition_idx] = slab + partition_idx * staging_bytes;
+    }
+    for (size_t i = 0; i < num_spare_bufs; ++i) {
+      free_bufs.push_back(slab + (num_partitions + i) * staging_bytes);
+    }
+  }
+
+  ~FragmentWriter() { free(slab); }
+
+  FragmentWriter(const FragmentWriter &) = delete;
+  FragmentWriter &operator=(const FragmentWriter &) = delete;
+
+  // Appends a record of `len` bytes to the partition. A record that does not
+  // fit in the rest of the staging buffer is split across extents.
+  inline void append(int partition_idx, const char *record, size_t len) {
+    ++frag_sizes[partition_idx];
+    auto &fill = buf_fills[partition_idx];
+    if (fill + len <= staging_bytes) {
+      memcpy(bufs[partition_idx] + fill, record, len);
+      fill += len;
+      return;
+    }
+
+    while (len > 0) {
+      if (fill == staging_bytes) _flush(partition_idx, false);
+      auto num_bytes = std::min(len, staging_bytes - fill);
+      memcpy(bufs[partition_idx] + fill, record, num_bytes);
+      fill += num_bytes;
+      record += num_bytes;
+      len -= num_bytes;
+    }
+  }
+
+  // Flushes all the staged records and waits for the writes to complete. With
+  // direct I/O, the last extent of each partition is padded to a full block.
+  void finish() {
+    for (int partition_idx = 0; partition_idx < num_partitions;
+         ++partition_idx) {
+      if (buf_fills[partition_idx] > 0) _flush(partition_idx, true);
+    }
+    io.drain();
+  }
+
+ private:
+  int spill_fd;
+  vector<spill_extent> &extents;
+  size_t spill_tail = 0;
+  size_t *frag_sizes;
+  const int num_partitions;
+  const size_t staging_bytes;
+  IOQueue &io;
+  const bool direct;
+
+  char *slab;
+  vector<char *> bufs;
+  vector<size_t> buf_fills;
+  vector<char *> free_bufs;
+  vector<char *> bufs_in_flight;
+
+  void _flush(int partition_idx, bool last) {
+    auto buf = bufs[partition_idx];
+    auto fill = buf_fills[partition_idx];
+
+    // Direct I/O only writes whole blocks. The bytes past the last full block
+    // are carried over to the next buffer, or zero-padded on the last flush.
+    auto write_len = fill;
+    if (direct) {
+      if (last) {
+        write_len = _align_up(fill);
+        memset(buf + fill, 0, write_len - fill);
+      } else {
+        write_len = _align_down(fill);
+      }
+    }
+
+    io.write(spill_fd, buf, write_len, spill_tail);
+    extents.push_back({partition_idx, spill_tail, write_len});
+    spill_tail += write_len;
+    bufs_in_flight.push_back(buf);
+    if (last) return;
+
+    if (free_bufs.empty()) {
+      io.drain();
+      free_bufs.swap(bufs_in_flight);
+    }
+    auto next_buf = free_bufs.back();
+    free_bufs.pop_back();
+
+    auto carry_len = fill - write_len;
+    memmove(next_buf, buf + write_len, carry_len);
+    bufs[partition_idx] = next_buf;
+    buf_fills[partition_idx] = carry_len;
+  }
+};
+
+}  // namespace internal
+}  // namespace elsar
@@ -5,20 +5,51 @@
 namespace elsar {
 
 // Namespace constants
-static constexpr size_t BYTES_PER_REC = 100; /* bytes */
-static constexpr size_t KEY_SZ = 10;         /* bytes */
-static constexpr char MAX_ASCII_CODE = '~';
 static const size_t IN_MEM_SORT_MEM_MULTIPLIER = 3;
 
 // Algorithm parameters
-static const size_t DEFAULT_RMI_ARCH[] = {1, 1000};
-static const size_t WRITE_BATCH_SZ = 1e3;         /* records */
+// The number of models per layer of the in-memory CDF models. A middle entry
+// adds an inner layer, which is kept only when it fits the sample better.
+static constexpr size_t DEFAULT_RMI_ARCH[] = {1, 1000, 1000};
+static const size_t WRITE_BATCH_BYTES = 1e5;      /* bytes */
 static const int TRAINING_SAMPLE_RECS = 1e7;      /* records */
 static const int AVG_PARTITION_RECS = 10'964'912; /* records */
 static const size_t READ_BATCH_RECS = 1e6;        /* records */
+static const size_t SAMPLE_BLOCK_RECS = 1e3;      /* records */
+static const size_t CONVERT_BATCH_RECS = 1024;    /* records */
+static const size_t PREDICT_BATCH_RECS = 256;     /* records */
+static const unsigned IO_QUEUE_DEPTH = 64;        /* requests */
+static const size_t IO_CHUNK_BYTES = 1 << 20;     /* bytes */
+static const size_t DIRECT_IO_ALIGNMENT = 4096;   /* bytes */
+static const double STAGING_MEM_FRACTION = .25;
+static const double READ_MEM_FRACTION = .25;
+static const size_t SORTER_PARTITIONS_IN_MEM = 2;
+static const size_t MIN_STAGING_BYTES = 1 << 16;  /* bytes */
+static const size_t MAX_STAGING_BYTES = 1 << 24;  /* bytes */
+static const size_t TMP_ROOT_SLOTS = 64;
 
-static const size_t TRAINING_SAMPLE_BYTES =
-    TRAINING_SAMPLE_RECS * BYTES_PER_REC;
+// Re-partitioning of the partitions that do not fit in memory
+static const size_t REPARTITION_BATCH_BYTES = 1 << 26; /* bytes */
+static const int MAX_REPARTITION_DEPTH = 3;
+
+// Newline-delimited records
+static const size_t LINE_READ_BATCH_BYTES = 1 << 26;     /* bytes */
+static const size_t LINE_SAMPLE_BLOCK_BYTES = 1 << 17;   /* bytes */
+static const size_t LINE_SAMPLE_BLOCKS = 4096;           /* blocks */
+static const size_t MAX_LINE_PARTITION_BYTES = 1 << 30;  /* bytes */
+static const long LINE_TIE_SORT_THRESHOLD = 64;          /* lines */
+static const size_t LINE_REPARTITION_SAMPLE_LINES = 1e5; /* lines */
+
+// Slices of the model of the whole input, for sorting the partitions
+static const long GLOBAL_MODEL_SAMPLE_PER_LEAF = 32; /* records */
+
+// Models saved by a previous run
+static const size_t DRIFT_CHECK_SAMPLE_RECS = 1e5; /* records */
+static const double MAX_MODEL_DRIFT = .01;         /* CDF distance */
+
+// Streams, whose size is unknown in advance
+static const size_t STREAM_PARTITIONS = 256;
+static const size_t STREAM_PARTITIONS_IN_MEM = 3;
 
 // Type definitions
 typedef char *record_t;
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <algorithm>
+#include <bit>
 #include <cmath>
 #include <iterator>
 #include <vector>
@@ -20,7 +21,14 @@ static constexpr int SECONDARY_FANOUT = 100;
 static constexpr int PRIMARY_FRAGMENT_CAPACITY = 100;
 static constexpr int SECONDARY_FRAGMENT_CAPACITY = 100;
 static constexpr int REP_CNT_THRESHOLD = 5;
-
+static constexpr size_t TOUCH_UP_SHIFTS_PER_ELM = 8;
+static constexpr long FEW_KEYS_SAMPLE_SZ = 1 << 15;
+static constexpr long MAX_FEW_KEYS = 1 << 14;
+
+// Insertion sort for the nearly sorted output of the model. Keys that the
+// model cannot tell apart (e.g. that only differ in their last character) may
+// leave long unsorted runs behind, so it falls back to a comparison sort once
+// it has shifted more than TOUCH_UP_SHIFTS_PER_ELM entries per element.
 template <class RandomIt>
 void _insertion_sort(RandomIt begin, RandomIt end) {
   // Determine the input size
@@ -28,21 +36,30 @@ void _insertion_sort(RandomIt begin, RandomIt end) {
 
   if (input_sz == 0) return;
 
+  const size_t max_shifts = TOUCH_UP_SHIFTS_PER_ELM * input_sz;
+  size_t num_shifts = 0;
+
   RandomIt cmp_idx;
-  Embedding key;
+  sort_entry key;
   for (auto i = begin + 1; i != end; ++i) {
     key = i[0];
     cmp_idx = i - 1;
-    while (cmp_idx >= begin &&
-           strncmp(cmp_idx[0].record, key.record, BYTES_PER_REC) > 0) {
+    while (cmp_idx >= begin && key < cmp_idx[0]) {
       cmp_idx[1] = cmp_idx[0];
       --cmp_idx;
+      ++num_shifts;
     }
     cmp_idx[1] = key;
+
+    if (num_shifts > max_shifts) {
+      std::sort(i + 1, end);
+      std::inplace_merge(begin, i + 1, end);
+      return;
+    }
   }
 }
 
-void _in_memory_sort_with_trained_model(Embedding *begin, Embedding *end,
+void _in_memory_sort_with_trained_model(sort_entry *begin, sort_entry *end,
                                         const TwoLayerRMI &rmi,
                                         size_t input_sz) {
   // Keeps track of the number of elements in each bucket
@@ -52,16 +69,26 @@ void _in_memory_sort_with_trained_model(Embedding *begin, Embedding *end,
   // partitioning steps for good
   long num_elms_finalized = 0;
 
-  // Cache the model parameters
-  const long num_leaf_models = rmi.hp.num_leaf_models;
-  double root_slope = rmi.root_model.slope;
-  double root_intercept = rmi.root_model.intercept;
-  double slopes[num_leaf_models];
-  double intercepts[num_leaf_models];
-  for (auto i = 0; i < num_leaf_models; ++i) {
-    slopes[i] = rmi.leaf_models[i].slope;
-    intercepts[i] = rmi.leaf_models[i].intercept;
-  }
+  // The partitioning and the defragmentation must agree on the bucket of every
+  // key, so they all predict through rmi.predict_cdfs() and these
+  auto predict_cdf = [&](const sort_entry &entry) {
+    double pred_cdf;
+    rmi.predict_cdfs(&entry, 1, &pred_cdf);
+    return pred_cdf;
+  };
+  auto primary_bucket_of = [](double pred_cdf) {
+    return static_cast<long>(std::max(
+        0., std::min(PRIMARY_FANOUT - 1., pred_cdf * PRIMARY_FANOUT)));
+  };
+  auto secondary_bucket_of = [](double pred_cdf, long primary_bucket_idx) {
+    return static_cast<long>(std::max(
+        0., std::min(SECONDARY_FANOUT - 1.,
+                     (pred_cdf * PRIMARY_FANOUT - primary_bucket_idx) *
+                         SECONDARY_FANOUT)));
+  };
+
+  // The CDFs predicted for a batch of keys ahead of partitioning them
+  double pred_cdfs[PREDICT_BATCH_RECS];
 
   //----------------------------------------------------------//
   //              PARTITION THE KEYS INTO BUCKETS             //
@@ -72,7 +99,7 @@ void _in_memory_sort_with_trained_model(Embedding *begin, Embedding *end,
     long fragment_sizes[PRIMARY_FANOUT]{0};
 
     // An auxiliary set of fragments where the elements will be partitioned
-    auto fragments = new Embedding[PRIMARY_FANOUT][PRIMARY_FRAGMENT_CAPACITY];
+    auto fragments = new sort_entry[PRIMARY_FANOUT][PRIMARY_FRAGMENT_CAPACITY];
 
     // Keeps track of the number of fragments that have been written back to the
     // original array
@@ -82,20 +109,18 @@ void _in_memory_sort_with_trained_model(Embedding *begin, Embedding *end,
     auto write_itr = begin;
 
     // For each element in the input, predict which bucket it would go to, and
-    // insert to the respective bucket fragment
+    // insert to the respective bucket fragment. The CDFs are predicted a batch
+    // at a time, ahead of the write iterator, which never passes `it`.
     for (auto it = begin; it != end; ++it) {
-      // Predict the model id in the leaf layer of the RMI
-      long pred_bucket_idx = static_cast<long>(std::max(
-          0., std::min(num_leaf_models - 1.,
-                       root_slope * it[0].converted_key + root_intercept)));
-
-      // Predict the CDF
-      double pred_cdf = slopes[pred_bucket_idx] * it[0].converted_key +
-                        intercepts[pred_bucket_idx];
+      const long batch_idx = (it - begin) % PREDICT_BATCH_RECS;
+      if (batch_idx == 0) {
+        rmi.predict_cdfs(
+            it, std::min<long>(PREDICT_BATCH_RECS, std::distance(it, end)),
+            pred_cdfs);
+      }
 
       // Get the predicted bucket id
-      pred_bucket_idx = static_cast<long>(std::max(
-          0., std::min(PRIMARY_FANOUT - 1., pred_cdf * PRIMARY_FANOUT)));
+      long pred_bucket_idx = primary_bucket_of(pred_cdfs[batch_idx]);
 
       // Place the current element in the predicted fragment
       fragments[pred_bucket_idx][fragment_sizes[pred_bucket_idx]] = it[0];
@@ -127,7 +152,7 @@ void _in_memory_sort_with_trained_model(Embedding *begin, Embedding *end,
     bucket_end_offset[0] = primary_bucket_sizes[0];
 
     // Swap space
-    Embedding *swap_buffer = new Embedding[PRIMARY_FRAGMENT_CAPACITY];
+    sort_entry *swap_buffer = new sort_entry[PRIMARY_FRAGMENT_CAPACITY];
 
     // Maintains a writing iterator for each bucket, initialized at the starting
     // offsets
@@ -180,19 +205,8 @@ void _in_memory_sort_with_trained_model(Embedding *begin, Embedding *end,
       // Find out what bucket the current fragment belongs to by looking at RMI
       // prediction for the first element of the fragment.
       auto first_elm_in_fragment = begin[cur_fragment_start_off];
-      long pred_bucket_for_cur_fragment = static_cast<long>(std::max(
-          0., std::min(num_leaf_models - 1.,
-                       root_slope * first_elm_in_fragment.converted_key +
-                           root_intercept)));
-
-      // Predict the CDF
-      double pred_cdf = slopes[pred_bucket_for_cur_fragment] *
-                            first_elm_in_fragment.converted_key +
-                        intercepts[pred_bucket_for_cur_fragment];
-
-      // Get the predicted bucket id
-      pred_bucket_for_cur_fragment = static_cast<long>(std::max(
-          0., std::min(PRIMARY_FANOUT - 1., pred_cdf * PRIMARY_FANOUT)));
+      long pred_bucket_for_cur_fragment =
+          primary_bucket_of(predict_cdf(first_elm_in_fragment));
 
       // If the current bucket contains fragments that are not all the way full,
       // no need to use a swap buffer, since there is available space. The first
@@ -318,24 +332,8 @@ void _in_memory_sort_with_trained_model(Embedding *begin, Embedding *end,
           auto first_elm_in_fragment_to_be_swapped_out =
               begin[bucket_write_off[pred_bucket_for_cur_fragment]];
 
-          long pred_bucket_for_fragment_to_be_swapped_out =
-              static_cast<long>(std::max(
-                  0.,
-                  std::min(num_leaf_models - 1.,
-                           root_slope * first_elm_in_fragment_to_be_swapped_out
-                                            .converted_key +
-                               root_intercept)));
-
-          // Predict the CDF
-          double pred_cdf =
-              slopes[pred_bucket_for_fragment_to_be_swapped_out] *
-                  first_elm_in_fragment_to_be_swapped_out.converted_key +
-              intercepts[pred_bucket_for_fragment_to_be_swapped_out];
-
-          // Get the predicted bucket idx
-          pred_bucket_for_fragment_to_be_swapped_out = static_cast<long>(
-              std::max(0., std::min(PRIMARY_FANOUT - 1.,
-                                    pred_cdf * PRIMARY_FANOUT)));
+          long pred_bucket_for_fragment_to_be_swapped_out = primary_bucket_of(
+              predict_cdf(first_elm_in_fragment_to_be_swapped_out));
 
           // If the fragment at the next write offset is not already in the
           // right bucket, swap the fragments
@@ -455,7 +453,7 @@ void _in_memory_sort_with_trained_model(Embedding *begin, Embedding *end,
 
         // An auxiliary set of fragments where the elements will be partitioned
         auto fragments =
-            new Embedding[SECONDARY_FANOUT][SECONDARY_FRAGMENT_CAPACITY];
+            new sort_entry[SECONDARY_FANOUT][SECONDARY_FRAGMENT_CAPACITY];
 
         // Keeps track of the number of fragments that have been written back to
         // the original array
@@ -467,20 +465,19 @@ void _in_memory_sort_with_trained_model(Embedding *begin, Embedding *end,
         // For each element in the input, predict which bucket it would go to,
         // and insert to the respective bucket fragment
         for (auto it = primary_bucket_start; it != primary_bucket_end; ++it) {
-          // Predict the model id in the leaf layer of the RMI
-          long pred_bucket_idx = static_cast<long>(std::max(
-              0., std::min(num_leaf_models - 1.,
-                           root_slope * it[0].converted_key + root_intercept)));
-
-          // Predict the CDF
-          double pred_cdf = slopes[pred_bucket_idx] * it[0].converted_key +
-                            intercepts[pred_bucket_idx];
+          const long batch_idx =
+              (it - primary_bucket_start) % PREDICT_BATCH_RECS;
+          if (batch_idx == 0) {
+            rmi.predict_cdfs(
+                it,
+                std::min<long>(PREDICT_BATCH_RECS,
+                               std::distance(it, primary_bucket_end)),
+                pred_cdfs);
+          }
 
           // Get the predicted bucket id
-          pred_bucket_idx = static_cast<long>(std::max(
-              0., std::min(SECONDARY_FANOUT - 1.,
-                           (pred_cdf * PRIMARY_FANOUT - primary_bucket_idx) *
-                               SECONDARY_FANOUT)));
+          long pred_bucket_idx =
+              secondary_bucket_of(pred_cdfs[batch_idx], primary_bucket_idx);
 
           // Place the current element in the predicted fragment
           fragments[pred_bucket_idx][fragment_sizes[pred_bucket_idx]] = it[0];
@@ -512,7 +509,7 @@ void _in_memory_sort_with_trained_model(Embedding *begin, Embedding *end,
         bucket_end_offset[0] = secondary_bucket_sizes[0];
 
         // Swap space
-        Embedding *swap_buffer = new Embedding[SECONDARY_FRAGMENT_CAPACITY];
+        sort_entry *swap_buffer = new sort_entry[SECONDARY_FRAGMENT_CAPACITY];
 
         // Maintains a writing iterator for each bucket, initialized at the
         // starting offsets
@@ -569,21 +566,8 @@ void _in_memory_sort_with_trained_model(Embedding *begin, Embedding *end,
           // RMI prediction for the first element of the fragment.
           auto first_elm_in_fragment =
               primary_bucket_start[cur_fragment_start_off];
-          long pred_bucket_for_cur_fragment = static_cast<long>(std::max(
-              0., std::min(num_leaf_models - 1.,
-                           root_slope * first_elm_in_fragment.converted_key +
-                               root_intercept)));
-
-          // Predict the CDF
-          double pred_cdf = slopes[pred_bucket_for_cur_fragment] *
-                                first_elm_in_fragment.converted_key +
-                            intercepts[pred_bucket_for_cur_fragment];
-
-          // Get the predicted bucket id
-          pred_bucket_for_cur_fragment = static_cast<long>(std::max(
-              0., std::min(SECONDARY_FANOUT - 1.,
-                           (pred_cdf * PRIMARY_FANOUT - primary_bucket_idx) *
-                               SECONDARY_FANOUT)));
+          long pred_bucket_for_cur_fragment = secondary_bucket_of(
+              predict_cdf(first_elm_in_fragment), primary_bucket_idx);
 
           // If the current bucket contains fragments that are not all the way
           // full, no need to use a swap fragment, since there is available
@@ -721,26 +705,9 @@ void _in_memory_sort_with_trained_model(Embedding *begin, Embedding *end,
                       [bucket_start_off[pred_bucket_for_cur_fragment]];
 
               long pred_bucket_for_fragment_to_be_swapped_out =
-                  static_cast<long>(std::max(
-                      0.,
-                      std::min(
-                          num_leaf_models - 1.,
-                          root_slope * first_elm_in_fragment_to_be_swapped_out
-                                           .converted_key +
-                              root_intercept)));
-
-              // Predict the CDF
-              double pred_cdf =
-                  slopes[pred_bucket_for_fragment_to_be_swapped_out] *
-                      first_elm_in_fragment_to_be_swapped_out.converted_key +
-                  intercepts[pred_bucket_for_fragment_to_be_swapped_out];
-
-              // Get the predicted bucket idx
-              pred_bucket_for_fragment_to_be_swapped_out = static_cast<long>(
-                  std::max(0., std::min(SECONDARY_FANOUT - 1.,
-                                        (pred_cdf * PRIMARY_FANOUT -
-                                         primary_bucket_idx) *
-                                            SECONDARY_FANOUT)));
+                  secondary_bucket_of(
+                      predict_cdf(first_elm_in_fragment_to_be_swapped_out),
+                      primary_bucket_idx);
 
               // If the fragment at the next write offset is not already in the
               // right bucket, swap the fragments
@@ -813,6 +780,12 @@ void _in_memory_sort_with_trained_model(Embedding *begin, Embedding *end,
         //- - - - - - - - - - - - - - - - - - - - - - - - - - - -  -//
         //                MODEL-BASED COUNTING SORT                 //
         //- - - - - - - - - - - - - - - - - - - - - - - - - - - -  -//
+        // The secondary buckets hold a few elements each, so the CDFs of the
+        // whole primary bucket are predicted at once
+        vector<double> primary_bucket_cdfs(primary_bucket_sz);
+        rmi.predict_cdfs(primary_bucket_start, primary_bucket_sz,
+                         primary_bucket_cdfs.data());
+
         // Iterate over the secondary buckets
         for (long secondary_bucket_idx = 0;
              secondary_bucket_idx < SECONDARY_FANOUT; ++secondary_bucket_idx) {
@@ -850,78 +823,23 @@ void _in_memory_sort_with_trained_model(Embedding *begin, Embedding *end,
             // Count array for the model-enhanced counting sort subroutine
             vector<long> cnt_hist(secondary_bucket_sz, 0);
 
-            /*
-             * OPTIMIZATION
-             * We check to see if the first and last element in the current
-             * bucket used the same leaf model to obtain their CDF. If that is
-             * the case, then we don't need to traverse the CDF model for
-             * every element in this bucket, hence decreasing the inference
-             * complexity from O(num_layer) to O(1).
-             */
-
-            long pred_model_first_elm = static_cast<long>(std::max(
-                0., std::min(num_leaf_models - 1.,
-                             root_slope * begin[secondary_bucket_start_off]
-                                              .converted_key +
-                                 root_intercept)));
-
-            long pred_model_last_elm = static_cast<long>(std::max(
-                0., std::min(num_leaf_models - 1.,
-                             root_slope * begin[secondary_bucket_end_off - 1]
-                                              .converted_key +
-                                 root_intercept)));
-
-            if (pred_model_first_elm == pred_model_last_elm) {
-              // Avoid CDF model traversal and predict the CDF only using the
-              // leaf model
-
-              // Iterate over the elements and place them into the secondary
-              // buckets
-              for (long elm_idx = 0; elm_idx < secondary_bucket_sz; ++elm_idx) {
-                // Find the current element
-                auto cur_key = begin[secondary_bucket_start_off + elm_idx];
-
-                // Predict the CDF
-                double pred_cdf =
-                    slopes[pred_model_first_elm] * cur_key.converted_key +
-                    intercepts[pred_model_first_elm];
-
-                // Scale the predicted CDF to the input size and save it
-                pred_cache_cs[elm_idx] = static_cast<long>(std::max(
-                    0., std::min(secondary_bucket_sz - 1.,
-                                 (pred_cdf * input_sz) - adjustment_offset)));
-
-                // Update the counts
-                ++cnt_hist[pred_cache_cs[elm_idx]];
-              }
-            } else {
-              // Fully traverse the CDF model again to predict the CDF of the
-              // current element
-
-              // Iterate over the elements and place them into the minor
-              // buckets
-              for (long elm_idx = 0; elm_idx < secondary_bucket_sz; ++elm_idx) {
-                // Find the current element
-                auto cur_key = begin[secondary_bucket_start_off + elm_idx];
-
-                // Predict the model idx in the leaf layer
-                auto model_idx_next_layer = static_cast<long>(
-                    std::max(0., std::min(num_leaf_models - 1.,
-                                          root_slope * cur_key.converted_key +
-                                              root_intercept)));
-                // Predict the CDF
-                double pred_cdf =
-                    slopes[model_idx_next_layer] * cur_key.converted_key +
-                    intercepts[model_idx_next_layer];
-
-                // Scale the predicted CDF to the input size and save it
-                pred_cache_cs[elm_idx] = static_cast<long>(std::max(
-                    0., std::min(secondary_bucket_sz - 1.,
-                                 (pred_cdf * input_sz) - adjustment_offset)));
-
-                // Update the counts
-                ++cnt_hist[pred_cache_cs[elm_idx]];
-              }
+            // The predicted CDFs of the elements of the bucket
+            const double *secondary_bucket_cdfs =
+                primary_bucket_cdfs.data() +
+                (begin + secondary_bucket_start_off - primary_bucket_start);
+
+            // Iterate over the elements and place them into the minor
+            // buckets
+            for (long elm_idx = 0; elm_idx < secondary_bucket_sz; ++elm_idx) {
+              double pred_cdf = secondary_bucket_cdfs[elm_idx];
+
+              // Scale the predicted CDF to the input size and save it
+              pred_cache_cs[elm_idx] = static_cast<long>(std::max(
+                  0., std::min(secondary_bucket_sz - 1.,
+                               (pred_cdf * input_sz) - adjustment_offset)));
+
+              // Update the counts
+              ++cnt_hist[pred_cache_cs[elm_idx]];
             }
 
             --cnt_hist[0];
@@ -933,7 +851,7 @@ void _in_memory_sort_with_trained_model(Embedding *begin, Embedding *end,
 
             // Allocate a temporary buffer for placing the keys in sorted
             // order
-            vector<Embedding> tmp(secondary_bucket_sz);
+            vector<sort_entry> tmp(secondary_bucket_sz);
 
             // Re-shuffle the elms based on the calculated cumulative counts
             for (long elm_idx = 0; elm_idx < secondary_bucket_sz; ++elm_idx) {
@@ -962,12 +880,163 @@ void _in_memory_sort_with_trained_model(Embedding *begin, Embedding *end,
   _insertion_sort(begin, end);
 }
 
-void _in_memory_sort_with_params(Embedding *begin, Embedding *end,
-                                 TwoLayerRMI::Params &params, size_t input_sz) {
+// An open-addressing hash table over a bounded number of distinct keys, which
+// maps each key to a slot holding a counter
+class KeyTable {
+ public:
+  struct slot {
+    converted_t converted_key;
+    uint16_t key_suffix;
+    bool used = false;
+    long value = 0;
+  };
+
+  explicit KeyTable(long max_keys) : num_keys(0), max_keys(max_keys) {
+    long capacity = 1;
+    while (capacity < 2 * max_keys) capacity <<= 1;
+    slots.resize(capacity);
+    mask = capacity - 1;
+    hash_shift = 64 - std::countr_zero(static_cast<unsigned long>(capacity));
+  }
+
+  // Returns the slot of the key of the entry, or -1 when the key is new and
+  // the table already holds `max_keys` keys
+  inline long find_or_insert(const sort_entry &entry) {
+    long idx = _hash(entry);
+    while (slots[idx].used) {
+      if (_matches(slots[idx], entry)) return idx;
+      idx = (idx + 1) & mask;
+    }
+    if (num_keys == max_keys) return -1;
+    slots[idx].used = true;
+    slots[idx].converted_key = entry.converted_key;
+    slots[idx].key_suffix = entry.key_suffix;
+    ++num_keys;
+    return idx;
+  }
+
+  // Returns the slot of the key of the entry, or -1 if it is not in the table
+  inline long find(const sort_entry &entry) const {
+    for (long idx = _hash(entry); slots[idx].used; idx = (idx + 1) & mask) {
+      if (_matches(slots[idx], entry)) return idx;
+    }
+    return -1;
+  }
+
+  // Returns the indices of the used slots in the order of their keys
+  vector<long> sorted_slots() const {
+    vector<long> sorted;
+    sorted.reserve(num_keys);
+    for (long idx = 0; idx <= mask; ++idx) {
+      if (slots[idx].used) sorted.push_back(idx);
+    }
+    std::sort(sorted.begin(), sorted.end(), [&](long a, long b) {
+      return slots[a].converted_key < slots[b].converted_key or
+             (slots[a].converted_key == slots[b].converted_key and
+              slots[a].key_suffix < slots[b].key_suffix);
+    });
+    return sorted;
+  }
+
+  vector<slot> slots;
+
+ private:
+  long mask;
+  int hash_shift;
+  long num_keys;
+  const long max_keys;
+
+  // Mixes both parts of the key with two multiplications, and keeps the
+  // highest bits, which depend on all the others
+  inline long _hash(const sort_entry &entry) const {
+    constexpr converted_t MULTIPLIER = 0x9e3779b97f4a7c15ul;
+    const converted_t hash =
+        (entry.converted_key * MULTIPLIER ^ entry.key_suffix) * MULTIPLIER;
+    return hash >> hash_shift;
+  }
+
+  static inline bool _matches(const slot &s, const sort_entry &entry) {
+    return s.converted_key == entry.converted_key and
+           s.key_suffix == entry.key_suffix;
+  }
+};
+
+// Counts the distinct keys in an evenly spaced sample of up to `sample_sz`
+// entries
+long _count_sampled_keys(const sort_entry *begin, const sort_entry *end,
+                         long sample_sz) {
+  const long input_sz = std::distance(begin, end);
+  sample_sz = std::min(sample_sz, input_sz);
+  vector<sort_entry> sample(sample_sz);
+  for (long i = 0; i < sample_sz; ++i) {
+    sample[i] = begin[i * input_sz / sample_sz];
+  }
+  std::sort(sample.begin(), sample.end());
+
+  long num_distinct = sample_sz > 0;
+  for (long i = 1; i < sample_sz; ++i) {
+    num_distinct += !sample[i].same_key(sample[i - 1]);
+  }
+  return num_distinct;
+}
+
+// Sorts entries with up to MAX_FEW_KEYS distinct keys by counting them in a
+// hash table, and placing each entry right after the entries of the smaller
+// keys. Returns false, leaving the entries untouched, when there are more
+// keys than that.
+bool _count_sort_few_keys(sort_entry *begin, sort_entry *end) {
+  KeyTable table(MAX_FEW_KEYS);
+  for (auto it = begin; it != end; ++it) {
+    long slot_idx = table.find_or_insert(*it);
+    if (slot_idx < 0) return false;
+    ++table.slots[slot_idx].value;
+  }
+
+  // Turn the counts into the offsets of the keys in the sorted order
+  long offset = 0;
+  for (auto slot_idx : table.sorted_slots()) {
+    auto cnt = table.slots[slot_idx].value;
+    table.slots[slot_idx].value = offset;
+    offset += cnt;
+  }
+
+  vector<sort_entry> sorted(std::distance(begin, end));
+  for (auto it = begin; it != end; ++it) {
+    sorted[table.slots[table.find(*it)].value++] = *it;
+  }
+  std::copy(sorted.begin(), sorted.end(), begin);
+  return true;
+}
+
+// Slices the model of the whole input for the key range of the entries.
+// Returns a null pointer, so that the entries get a model of their own, when
+// there is no such model or it is too coarse for their range.
+const TwoLayerRMI *_slice_model(const sort_entry *begin, const sort_entry *end,
+                                const TwoLayerRMI *input_rmi,
+                                TwoLayerRMI &sliced) {
+  if (!input_rmi or begin == end) return nullptr;
+  auto minmax = std::minmax_element(
+      begin, end, [](const sort_entry &a, const sort_entry &b) {
+        return a.converted_key < b.converted_key;
+      });
+  return input_rmi->slice(minmax.first->converted_key,
+                          minmax.second->converted_key, sliced)
+             ? &sliced
+             : nullptr;
+}
+
+// Sorts the entries with the `trained_rmi` model when there is one, and with a
+// model trained over them otherwise
+void _in_memory_sort_with_params(sort_entry *begin, sort_entry *end,
+                                 TwoLayerRMI::Params &params, size_t input_sz,
+                                 const TwoLayerRMI *trained_rmi = nullptr) {
   if (std::distance(begin, end) <=
       std::max<long>(params.fanout * params.threshold,
                      5 * params.num_leaf_models)) {
     std::sort(begin, end);
+  } else if (trained_rmi) {
+    elsar::internal::_in_memory_sort_with_trained_model(begin, end,
+                                                        *trained_rmi, input_sz);
   } else {
     // Initialize the RMI
     TwoLayerRMI rmi(params);
@@ -985,10 +1054,128 @@ void _in_memory_sort_with_params(Embedding *begin, Embedding *end,
   }
 }
 
-void in_memory_sort(Embedding *begin, Embedding *end, size_t input_sz) {
+// Sorts the entries with `num_threads` threads. The threads route the entries
+// to equi-depth buckets by their predicted CDF together, and then sort the
+// buckets independently of each other.
+void _parallel_in_memory_sort(sort_entry *begin, sort_entry *end,
+                              size_t input_sz, int num_threads,
+                              const TwoLayerRMI *trained_rmi = nullptr) {
+  TwoLayerRMI trained_here;
+  if (!trained_rmi) {
+    if (!trained_here.train(begin, end)) {
+      std::sort(begin, end);
+      return;
+    }
+  }
+  const TwoLayerRMI &rmi = trained_rmi ? *trained_rmi : trained_here;
+
+  auto bucket_of = [](double pred_cdf) {
+    return static_cast<unsigned short>(std::max(
+        0., std::min(PRIMARY_FANOUT - 1., pred_cdf * PRIMARY_FANOUT)));
+  };
+
+  // Each thread predicts the buckets of a chunk of the input, a batch of CDFs
+  // at a time, and counts the number of its elements in each bucket
+  const long chunk_sz = (input_sz + num_threads - 1) / num_threads;
+  vector<unsigned short> pred_buckets(input_sz);
+  vector<vector<long>> bucket_offsets(num_threads,
+                                      vector<long>(PRIMARY_FANOUT, 0));
+#pragma omp parallel for num_threads(num_threads)
+  for (int th_idx = 0; th_idx < num_threads; ++th_idx) {
+    const long chunk_end = std::min<long>(input_sz, (th_idx + 1) * chunk_sz);
+    double pred_cdfs[PREDICT_BATCH_RECS];
+    for (long batch_start = th_idx * chunk_sz; batch_start < chunk_end;
+         batch_start += PREDICT_BATCH_RECS) {
+      const long batch_sz =
+          std::min<long>(PREDICT_BATCH_RECS, chunk_end - batch_start);
+      rmi.predict_cdfs(begin + batch_start, batch_sz, pred_cdfs);
+      for (long i = 0; i < batch_sz; ++i) {
+        pred_buckets[batch_start + i] = bucket_of(pred_cdfs[i]);
+        ++bucket_offsets[th_idx][pred_buckets[batch_start + i]];
+      }
+    }
+  }
+
+  // Turn the counts into the offsets where each thread writes its elements of
+  // each bucket
+  vector<long> bucket_starts(PRIMARY_FANOUT + 1, 0);
+  long offset = 0;
+  for (int bucket_idx = 0; bucket_idx < PRIMARY_FANOUT; ++bucket_idx) {
+    bucket_starts[bucket_idx] = offset;
+    for (int th_idx = 0; th_idx < num_threads; ++th_idx) {
+      auto cnt = bucket_offsets[th_idx][bucket_idx];
+      bucket_offsets[th_idx][bucket_idx] = offset;
+      offset += cnt;
+    }
+  }
+  bucket_starts[PRIMARY_FANOUT] = offset;
+
+  // Scatter the elements to their buckets
+  sort_entry *buckets = new sort_entry[input_sz];
+#pragma omp parallel for num_threads(num_threads)
+  for (int th_idx = 0; th_idx < num_threads; ++th_idx) {
+    const long chunk_end = std::min<long>(input_sz, (th_idx + 1) * chunk_sz);
+    auto &offsets = bucket_offsets[th_idx];
+    for (long i = th_idx * chunk_sz; i < chunk_end; ++i) {
+      buckets[offsets[pred_buckets[i]]++] = begin[i];
+    }
+  }
+  pred_buckets.clear();
+  pred_buckets.shrink_to_fit();
+
+  // Sort the buckets independently and write them back to the input
+#pragma omp parallel for num_threads(num_threads) schedule(dynamic)
+  for (int bucket_idx = 0; bucket_idx < PRIMARY_FANOUT; ++bucket_idx) {
+    auto bucket_begin = buckets + bucket_starts[bucket_idx];
+    auto bucket_end = buckets + bucket_starts[bucket_idx + 1];
+    if (bucket_begin == bucket_end) continue;
+
+    // A given model is sliced further for each bucket
+    TwoLayerRMI::Params p;
+    TwoLayerRMI sliced;
+    _in_memory_sort_with_params(
+        bucket_begin, bucket_end, p, std::distance(bucket_begin, bucket_end),
+        _slice_model(bucket_begin, bucket_end, trained_rmi, sliced));
+    std::copy(bucket_begin, bucket_end, begin + bucket_starts[bucket_idx]);
+  }
+  delete[] buckets;
+
+  // The model is not strictly monotonic at the boundaries of its leaves
+  _insertion_sort(begin, end);
+}
+
+// Sorts the entries of a partition, with the help of `num_threads` threads
+// when more than one is available. With the model of the whole input
+// (`input_rmi`), the partition is sorted with a slice of it instead of a
+// model trained from scratch, unless the slice is too coarse.
+void in_memory_sort(sort_entry *begin, sort_entry *end, size_t input_sz,
+                    int num_threads = 1,
+                    const TwoLayerRMI *input_rmi = nullptr) {
   if (begin != end) {
     TwoLayerRMI::Params p;
-    elsar::internal::_in_memory_sort_with_params(begin, end, p, input_sz);
+
+    // Inputs whose keys repeat REP_CNT_THRESHOLD times on average in a sample
+    // likely have few enough of them to be sorted by counting, which beats
+    // training a model over a CDF made of steps
+    const long input_len = std::distance(begin, end);
+    if (input_len > p.fanout * p.threshold and
+        _count_sampled_keys(begin, end, FEW_KEYS_SAMPLE_SZ) *
+                REP_CNT_THRESHOLD <=
+            std::min(FEW_KEYS_SAMPLE_SZ, input_len) and
+        _count_sort_few_keys(begin, end)) {
+      return;
+    }
+
+    TwoLayerRMI sliced;
+    auto trained_rmi = _slice_model(begin, end, input_rmi, sliced);
+    if (num_threads > 1 and
+        std::distance(begin, end) > p.fanout * p.threshold) {
+      elsar::internal::_parallel_in_memory_sort(begin, end, input_sz,
+                                                num_threads, trained_rmi);
+    } else {
+      elsar::internal::_in_memory_sort_with_params(begin, end, p, input_sz,
+                                                   trained_rmi);
+    }
   }
 }
 
@@ -0,0 +1,365 @@
+#pragma once
+
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <vector>
+
+#include "../options.h"
+#include "globals.h"
+
+using namespace std;
+
+namespace elsar {
+namespace internal {
+
+inline void _io_fail(const char *msg, int err) {
+  cerr << "ERROR: " << msg << endl;
+  cerr << strerror(err) << endl;
+  exit(EXIT_FAILURE);
+}
+
+// Rounds byte offsets to the block size required by O_DIRECT
+inline size_t _align_down(size_t off) {
+  return off / DIRECT_IO_ALIGNMENT * DIRECT_IO_ALIGNMENT;
+}
+
+inline size_t _align_up(size_t off) {
+  return _align_down(off + DIRECT_IO_ALIGNMENT - 1);
+}
+
+// Allocates a buffer usable for O_DIRECT transfers. Release with free().
+inline char *_alloc_aligned(size_t sz) {
+  auto buf = static_cast<char *>(
+      aligned_alloc(DIRECT_IO_ALIGNMENT, _align_up(std::max<size_t>(sz, 1))));
+  if (!buf) _io_fail("Could not allocate I/O buffer.", ENOMEM);
+  return buf;
+}
+
+// Opens a file for direct I/O, falling back to buffered I/O when the file
+// system does not support O_DIRECT
+inline int _open_direct(const char *path, int flags, mode_t mode = 0) {
+  int fd = open(path, flags | O_DIRECT, mode);
+  if (fd < 0 and errno == EINVAL) {
+    static once_flag warned;
+    call_once(warned, [path]() {
+      cerr << "\33[93;1mWARNING\33[0m: O_DIRECT is not supported under "
+           << path << ". Using buffered I/O." << endl;
+    });
+    fd = open(path, flags, mode);
+  }
+  return fd;
+}
+
+// Blocking positioned I/O that retries on short transfers
+inline void _pread_fully(int fd, char *buf, size_t len, off_t off) {
+  while (len > 0) {
+    auto ret = pread(fd, buf, len, off);
+    if (ret < 0 and errno == EINTR) continue;
+    if (ret <= 0) _io_fail("Could not read file.", ret == 0 ? EIO : errno);
+    buf += ret;
+    off += ret;
+    len -= ret;
+  }
+}
+
+inline void _pwrite_fully(int fd, const char *buf, size_t len, off_t off) {
+  while (len > 0) {
+    auto ret = pwrite(fd, buf, len, off);
+    if (ret < 0 and errno == EINTR) continue;
+    if (ret <= 0) _io_fail("Could not write file.", ret == 0 ? EIO : errno);
+    buf += ret;
+    off += ret;
+    len -= ret;
+  }
+}
+
+// Sequential I/O for the streams that cannot seek, such as pipes. Reads return
+// fewer bytes than asked for only at the end of the stream.
+inline size_t _read_fully(int fd, char *buf, size_t len) {
+  size_t done = 0;
+  while (done < len) {
+    auto ret = read(fd, buf + done, len - done);
+    if (ret < 0 and errno == EINTR) continue;
+    if (ret < 0) _io_fail("Could not read stream.", errno);
+    if (ret == 0) break;
+    done += ret;
+  }
+  return done;
+}
+
+inline void _write_fully(int fd, const char *buf, size_t len) {
+  while (len > 0) {
+    auto ret = write(fd, buf, len);
+    if (ret < 0 and errno == EINTR) continue;
+    if (ret <= 0) _io_fail("Could not write stream.", ret == 0 ? EIO : errno);
+    buf += ret;
+    len -= ret;
+  }
+}
+
+// Writes the iovecs at the given offset, skipping the first `done` bytes
+inline void _pwritev_fully(int fd, const iovec *iov, int iovcnt, off_t off,
+                           size_t done = 0) {
+  vector<iovec> remaining(iov, iov + iovcnt);
+  auto itr = remaining.begin();
+  while (itr != remaining.end()) {
+    // Skip over the bytes that have already been written
+    while (itr != remaining.end() and done >= itr->iov_len) {
+      done -= itr->iov_len;
+      off += itr->iov_len;
+      ++itr;
+    }
+    if (itr == remaining.end()) break;
+    itr->iov_base = static_cast<char *>(itr->iov_base) + done;
+    itr->iov_len -= done;
+    off += done;
+
+    int cnt = std::min<long>(std::distance(itr, remaining.end()), IOV_MAX);
+    auto ret = pwritev(fd, &*itr, cnt, off);
+    if (ret < 0 and errno == EINTR) {
+      done = 0;
+      continue;
+    }
+    if (ret <= 0) _io_fail("Could not write file.", ret == 0 ? EIO : errno);
+    done = ret;
+  }
+}
+
+// A per-thread queue of positioned reads and writes.
+//
+// With the POSIX engine every request completes before the call returns. With
+// io_uring, requests are batched into a submission ring of IO_QUEUE_DEPTH
+// entries and only complete by the time drain() returns, so the buffers (and
+// iovec arrays) passed in MUST stay alive and untouched until then.
+class IOQueue {
+ public:
+  IOQueue(IOEngine engine, unsigned depth = IO_QUEUE_DEPTH)
+      : ring_fd(-1), depth(depth) {
+    if (engine == IOEngine::IO_URING) _setup_ring();
+  }
+
+  ~IOQueue() {
+    if (ring_fd >= 0) {
+      drain();
+      munmap(sqes, sq_entries * sizeof(io_uring_sqe));
+      munmap(cq_ring_ptr, cq_ring_sz);
+      if (sq_ring_ptr != cq_ring_ptr) munmap(sq_ring_ptr, sq_ring_sz);
+      close(ring_fd);
+    }
+  }
+
+  IOQueue(const IOQueue &) = delete;
+  IOQueue &operator=(const IOQueue &) = delete;
+
+  bool uses_io_uring() const { return ring_fd >= 0; }
+
+  void read(int fd, char *buf, size_t len, off_t off) {
+    if (ring_fd < 0) return _pread_fully(fd, buf, len, off);
+    for (size_t done = 0; done < len; done += IO_CHUNK_BYTES) {
+      _push({IORING_OP_READ, fd, buf + done,
+             std::min<size_t>(IO_CHUNK_BYTES, len - done),
+             static_cast<off_t>(off + done), 0});
+    }
+  }
+
+  void write(int fd, const char *buf, size_t len, off_t off) {
+    if (ring_fd < 0) return _pwrite_fully(fd, buf, len, off);
+    for (size_t done = 0; done < len; done += IO_CHUNK_BYTES) {
+      _push({IORING_OP_WRITE, fd, const_cast<char *>(buf) + done,
+             std::min<size_t>(IO_CHUNK_BYTES, len - done),
+             static_cast<off_t>(off + done), 0});
+    }
+  }
+
+  // Gathers the buffers of the iovecs into one contiguous range of the file
+  void writev(int fd, const iovec *iov, int iovcnt, off_t off) {
+    for (int first = 0; first < iovcnt; first += IOV_MAX) {
+      int cnt = std::min(IOV_MAX, iovcnt - first);
+      size_t len = 0;
+      for (int i = first; i < first + cnt; ++i) len += iov[i].iov_len;
+
+      if (ring_fd < 0) {
+        _pwritev_fully(fd, iov + first, cnt, off);
+      } else {
+        _push({IORING_OP_WRITEV, fd, const_cast<iovec *>(iov + first), len,
+               off, cnt});
+      }
+      off += len;
+    }
+  }
+
+  // Waits until all the queued requests complete
+  void drain() {
+    if (ring_fd >= 0) _reap(in_flight);
+  }
+
+ private:
+  // A request that was pushed to the ring
+  struct request {
+    int opcode;
+    int fd;
+    void *buf;
+    size_t len;
+    off_t off;
+    int iovcnt;
+  };
+
+  int ring_fd;
+  unsigned depth;
+  unsigned in_flight = 0;
+  unsigned to_submit = 0;
+  vector<request> requests;
+  vector<unsigned> free_slots;
+
+  // Shared ring memory
+  void *sq_ring_ptr = nullptr;
+  void *cq_ring_ptr = nullptr;
+  size_t sq_ring_sz = 0;
+  size_t cq_ring_sz = 0;
+  unsigned sq_entries = 0;
+  unsigned *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  io_uring_sqe *sqes;
+  io_uring_cqe *cqes;
+
+  void _setup_ring() {
+    io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = syscall(__NR_io_uring_setup, depth, &p);
+    if (fd < 0) {
+      cerr << "\33[93;1mWARNING\33[0m: io_uring is not available ("
+           << strerror(errno) << "). Using POSIX I/O." << endl;
+      return;
+    }
+
+    sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_ring_sz = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+      sq_ring_sz = cq_ring_sz = std::max(sq_ring_sz, cq_ring_sz);
+    }
+
+    sq_ring_ptr = mmap(nullptr, sq_ring_sz, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (sq_ring_ptr == MAP_FAILED) _io_fail("Could not map io_uring.", errno);
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+      cq_ring_ptr = sq_ring_ptr;
+    } else {
+      cq_ring_ptr = mmap(nullptr, cq_ring_sz, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+      if (cq_ring_ptr == MAP_FAILED) _io_fail("Could not map io_uring.", errno);
+    }
+
+    sqes = static_cast<io_uring_sqe *>(
+        mmap(nullptr, p.sq_entries * sizeof(io_uring_sqe),
+             PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+             IORING_OFF_SQES));
+    if (sqes == MAP_FAILED) _io_fail("Could not map io_uring.", errno);
+
+    auto sq_base = static_cast<char *>(sq_ring_ptr);
+    auto cq_base = static_cast<char *>(cq_ring_ptr);
+    sq_tail = reinterpret_cast<unsigned *>(sq_base + p.sq_off.tail);
+    sq_mask = reinterpret_cast<unsigned *>(sq_base + p.sq_off.ring_mask);
+    sq_array = reinterpret_cast<unsigned *>(sq_base + p.sq_off.array);
+    cq_head = reinterpret_cast<unsigned *>(cq_base + p.cq_off.head);
+    cq_tail = reinterpret_cast<unsigned *>(cq_base + p.cq_off.tail);
+    cq_mask = reinterpret_cast<unsigned *>(cq_base + p.cq_off.ring_mask);
+    cqes = reinterpret_cast<io_uring_cqe *>(cq_base + p.cq_off.cqes);
+
+    sq_entries = p.sq_entries;
+    depth = std::min(depth, p.sq_entries);
+    requests.resize(depth);
+    for (unsigned slot = 0; slot < depth; ++slot) free_slots.push_back(slot);
+    ring_fd = fd;
+  }
+
+  void _push(request req) {
+    // Make room in the ring by waiting for the oldest requests
+    if (in_flight == depth) _reap(1);
+
+    auto slot = free_slots.back();
+    free_slots.pop_back();
+    requests[slot] = req;
+
+    unsigned tail = *sq_tail;
+    unsigned idx = tail & *sq_mask;
+    auto sqe = &sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = req.opcode;
+    sqe->fd = req.fd;
+    sqe->off = req.off;
+    sqe->addr = reinterpret_cast<unsigned long>(req.buf);
+    sqe->len = req.opcode == IORING_OP_WRITEV ? req.iovcnt : req.len;
+    sqe->user_data = slot;
+    sq_array[idx] = idx;
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    ++to_submit;
+    ++in_flight;
+  }
+
+  // Submits the pending requests and waits for at least `min_complete` of the
+  // requests in flight to complete
+  void _reap(unsigned min_complete) {
+    unsigned reaped = 0;
+    while (to_submit > 0 or reaped < min_complete) {
+      unsigned wait_for = reaped < min_complete ? 1 : 0;
+      int ret = syscall(__NR_io_uring_enter, ring_fd, to_submit, wait_for,
+                        wait_for ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+      if (ret < 0) {
+        if (errno == EINTR or errno == EAGAIN or errno == EBUSY) continue;
+        _io_fail("io_uring_enter failed.", errno);
+      }
+      to_submit -= ret;
+
+      unsigned head = *cq_head;
+      unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+      for (; head != tail; ++head) {
+        auto cqe = &cqes[head & *cq_mask];
+        _complete(cqe->user_data, cqe->res);
+        ++reaped;
+      }
+      __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+    }
+  }
+
+  void _complete(unsigned slot, int res) {
+    auto &req = requests[slot];
+    if (res < 0) {
+      _io_fail(req.opcode == IORING_OP_READ ? "Could not read file."
+                                            : "Could not write file.",
+               -res);
+    }
+
+    // Finish short transfers synchronously
+    size_t done = res;
+    if (done < req.len) {
+      auto buf = static_cast<char *>(req.buf);
+      if (req.opcode == IORING_OP_READ) {
+        _pread_fully(req.fd, buf + done, req.len - done, req.off + done);
+      } else if (req.opcode == IORING_OP_WRITE) {
+        _pwrite_fully(req.fd, buf + done, req.len - done, req.off + done);
+      } else {
+        _pwritev_fully(req.fd, static_cast<iovec *>(req.buf), req.iovcnt,
+                       req.off, done);
+      }
+    }
+
+    free_slots.push_back(slot);
+    --in_flight;
+  }
+};
+
+}  // namespace internal
+}  // namespace elsar
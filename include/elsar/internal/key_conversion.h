@@ -0,0 +1,277 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "../record_layout.h"
+#include "globals.h"
+
+namespace elsar {
+namespace internal {
+
+// A printable key is normalized by reading its first characters as the digits
+// of a base-95 number, with the first printable character as the digit zero
+static constexpr unsigned char KEY_MIN_CHAR = 32;
+static constexpr converted_t KEY_RADIX = 95;
+static constexpr int MAX_CONVERTED_CHARS = 9;
+
+constexpr converted_t _radix_pow(int exp) {
+  converted_t value = 1;
+  for (int i = 0; i < exp; ++i) value *= KEY_RADIX;
+  return value;
+}
+
+// The constants for converting the first `NUM_CHARS` characters of printable
+// keys
+template <int NUM_CHARS>
+struct printable_key_encoding {
+  static_assert(NUM_CHARS >= 1 and NUM_CHARS <= MAX_CONVERTED_CHARS,
+                "Keys are converted from 1 to 9 characters");
+
+  // The place value of each converted character
+  static constexpr std::array<converted_t, NUM_CHARS> place_values = [] {
+    std::array<converted_t, NUM_CHARS> values{};
+    for (int i = 0; i < NUM_CHARS; ++i) {
+      values[i] = _radix_pow(NUM_CHARS - 1 - i);
+    }
+    return values;
+  }();
+
+  // The value subtracted from a key converted from its raw characters, which
+  // accounts for KEY_MIN_CHAR in every digit
+  static constexpr converted_t char_offset = [] {
+    converted_t offset = 0;
+    for (auto place_value : place_values) offset += KEY_MIN_CHAR * place_value;
+    return offset;
+  }();
+
+  // The vector kernels load 16 bytes per key and reduce them in two steps.
+  // The bytes are first combined in pairs, and the pairs in groups of four
+  // bytes, so that each 16-byte lane holds the partial values of characters
+  // 0-3, 4-7 and 8 as 32-bit integers. The bytes past the converted
+  // characters weigh nothing.
+  static constexpr int LOAD_BYTES = 16;
+  static constexpr int NUM_GROUPS = 3;
+
+  static constexpr std::array<int8_t, LOAD_BYTES> byte_weights = [] {
+    std::array<int8_t, LOAD_BYTES> weights{};
+    for (int i = 0; i < NUM_CHARS; ++i) {
+      auto pair_end = std::min(NUM_CHARS, i / 2 * 2 + 2);
+      weights[i] = static_cast<int8_t>(_radix_pow(pair_end - 1 - i));
+    }
+    return weights;
+  }();
+
+  static constexpr std::array<int16_t, LOAD_BYTES / 2> pair_weights = [] {
+    std::array<int16_t, LOAD_BYTES / 2> weights{};
+    for (int pair = 0; 2 * pair < NUM_CHARS; ++pair) {
+      auto pair_end = std::min(NUM_CHARS, 2 * pair + 2);
+      auto group_end = std::min(NUM_CHARS, pair / 2 * 4 + 4);
+      weights[pair] = static_cast<int16_t>(_radix_pow(group_end - pair_end));
+    }
+    return weights;
+  }();
+
+  static constexpr std::array<converted_t, NUM_GROUPS> group_place_values =
+      [] {
+        std::array<converted_t, NUM_GROUPS> values{};
+        for (int group = 0; 4 * group < NUM_CHARS; ++group) {
+          auto group_end = std::min(NUM_CHARS, 4 * group + 4);
+          values[group] = _radix_pow(NUM_CHARS - group_end);
+        }
+        return values;
+      }();
+};
+
+template <int NUM_CHARS>
+inline converted_t _convert_key_scalar(const char *key) {
+  using encoding = printable_key_encoding<NUM_CHARS>;
+  converted_t value = 0;
+  for (int i = 0; i < NUM_CHARS; ++i) {
+    value += static_cast<converted_t>(key[i]) * encoding::place_values[i];
+  }
+  return value - encoding::char_offset;
+}
+
+template <int NUM_CHARS>
+inline void _convert_keys_scalar(const char *keys, size_t stride,
+                                 size_t num_keys, converted_t *out) {
+  for (size_t i = 0; i < num_keys; ++i) {
+    out[i] = _convert_key_scalar<NUM_CHARS>(keys + i * stride);
+  }
+}
+
+#if defined(__x86_64__)
+// The signed characters are used as is, and the character offset is
+// subtracted at the end, so that every key converts to exactly the same value
+// as with the scalar code
+template <int NUM_CHARS>
+inline converted_t _combine_key_parts(const int32_t *parts) {
+  using encoding = printable_key_encoding<NUM_CHARS>;
+  converted_t value = 0;
+  for (int group = 0; group < encoding::NUM_GROUPS; ++group) {
+    value += static_cast<converted_t>(static_cast<int64_t>(parts[group])) *
+             encoding::group_place_values[group];
+  }
+  return value - encoding::char_offset;
+}
+
+template <int NUM_CHARS>
+__attribute__((target("avx2"))) inline void _convert_keys_avx2(
+    const char *keys, size_t stride, size_t num_keys, converted_t *out) {
+  using encoding = printable_key_encoding<NUM_CHARS>;
+  const __m256i byte_weights = _mm256_broadcastsi128_si256(_mm_loadu_si128(
+      reinterpret_cast<const __m128i *>(encoding::byte_weights.data())));
+  const __m256i pair_weights = _mm256_broadcastsi128_si256(_mm_loadu_si128(
+      reinterpret_cast<const __m128i *>(encoding::pair_weights.data())));
+
+  size_t i = 0;
+  alignas(32) int32_t parts[8];
+  for (; i + 2 <= num_keys; i += 2) {
+    auto keys_vec = _mm256_loadu2_m128i(
+        reinterpret_cast<const __m128i *>(keys + (i + 1) * stride),
+        reinterpret_cast<const __m128i *>(keys + i * stride));
+    auto pairs = _mm256_maddubs_epi16(byte_weights, keys_vec);
+    auto groups = _mm256_madd_epi16(pairs, pair_weights);
+    _mm256_store_si256(reinterpret_cast<__m256i *>(parts), groups);
+    out[i] = _combine_key_parts<NUM_CHARS>(parts);
+    out[i + 1] = _combine_key_parts<NUM_CHARS>(parts + 4);
+  }
+  _convert_keys_scalar<NUM_CHARS>(keys + i * stride, stride, num_keys - i,
+                                  out + i);
+}
+
+template <int NUM_CHARS>
+__attribute__((target("avx512f,avx512bw"))) inline void _convert_keys_avx512(
+    const char *keys, size_t stride, size_t num_keys, converted_t *out) {
+  using encoding = printable_key_encoding<NUM_CHARS>;
+  const __m512i byte_weights = _mm512_broadcast_i32x4(_mm_loadu_si128(
+      reinterpret_cast<const __m128i *>(encoding::byte_weights.data())));
+  const __m512i pair_weights = _mm512_broadcast_i32x4(_mm_loadu_si128(
+      reinterpret_cast<const __m128i *>(encoding::pair_weights.data())));
+
+  size_t i = 0;
+  alignas(64) int32_t parts[16];
+  for (; i + 4 <= num_keys; i += 4) {
+    auto low_keys = _mm256_loadu2_m128i(
+        reinterpret_cast<const __m128i *>(keys + (i + 1) * stride),
+        reinterpret_cast<const __m128i *>(keys + i * stride));
+    auto high_keys = _mm256_loadu2_m128i(
+        reinterpret_cast<const __m128i *>(keys + (i + 3) * stride),
+        reinterpret_cast<const __m128i *>(keys + (i + 2) * stride));
+    auto keys_vec =
+        _mm512_inserti64x4(_mm512_castsi256_si512(low_keys), high_keys, 1);
+    auto pairs = _mm512_maddubs_epi16(byte_weights, keys_vec);
+    auto groups = _mm512_madd_epi16(pairs, pair_weights);
+    _mm512_store_si512(parts, groups);
+    for (int lane = 0; lane < 4; ++lane) {
+      out[i + lane] = _combine_key_parts<NUM_CHARS>(parts + 4 * lane);
+    }
+  }
+  _convert_keys_scalar<NUM_CHARS>(keys + i * stride, stride, num_keys - i,
+                                  out + i);
+}
+#endif
+
+typedef void (*convert_keys_fn)(const char *, size_t, size_t, converted_t *);
+
+// Picks the widest conversion kernel supported by the CPU
+template <int NUM_CHARS>
+inline convert_keys_fn _select_convert_keys_kernel() {
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512bw")) {
+    return _convert_keys_avx512<NUM_CHARS>;
+  }
+  if (__builtin_cpu_supports("avx2")) return _convert_keys_avx2<NUM_CHARS>;
+#endif
+  return _convert_keys_scalar<NUM_CHARS>;
+}
+
+// Converts `num_keys` printable keys laid out `stride` bytes apart into `out`,
+// where `key_span` bytes may be read from the start of the last key. The
+// vector kernels read 16 bytes per key, so the keys that would make them read
+// past the end are converted with the scalar code.
+template <int NUM_CHARS>
+inline void _convert_printable_keys(const char *keys, size_t stride,
+                                    size_t num_keys, converted_t *out,
+                                    size_t key_span) {
+  static const convert_keys_fn kernel =
+      _select_convert_keys_kernel<NUM_CHARS>();
+  constexpr size_t load_bytes = printable_key_encoding<NUM_CHARS>::LOAD_BYTES;
+  size_t num_vector_keys = num_keys;
+  if (key_span < load_bytes) {
+    const size_t tail_keys = (load_bytes - key_span + stride - 1) / stride;
+    num_vector_keys = num_keys > tail_keys ? num_keys - tail_keys : 0;
+  }
+  kernel(keys, stride, num_vector_keys, out);
+  _convert_keys_scalar<NUM_CHARS>(keys + num_vector_keys * stride, stride,
+                                  num_keys - num_vector_keys,
+                                  out + num_vector_keys);
+}
+
+// A binary key is normalized by reading its first bytes as a big-endian
+// unsigned integer, which preserves their lexicographic order
+template <int NUM_BYTES>
+inline converted_t _convert_binary_key(const char *key) {
+  static_assert(NUM_BYTES >= 1 and NUM_BYTES <= 8,
+                "Binary keys are converted from 1 to 8 bytes");
+  converted_t value = 0;
+  for (int i = 0; i < NUM_BYTES; ++i) {
+    value = value << 8 | static_cast<unsigned char>(key[i]);
+  }
+  return value;
+}
+
+template <int NUM_BYTES>
+inline void _convert_binary_keys(const char *keys, size_t stride,
+                                 size_t num_keys, converted_t *out) {
+  for (size_t i = 0; i < num_keys; ++i) {
+    out[i] = _convert_binary_key<NUM_BYTES>(keys + i * stride);
+  }
+}
+
+// Converts a key of the layout
+template <class Layout>
+inline converted_t _convert_key(const char *key) {
+  if constexpr (Layout::KEY_ENCODING == KeyEncoding::BINARY) {
+    return _convert_binary_key<Layout::NUM_CONVERTED_CHARS>(key);
+  } else {
+    return _convert_key_scalar<Layout::NUM_CONVERTED_CHARS>(key);
+  }
+}
+
+// Converts `num_keys` keys of the layout laid out `stride` bytes apart into
+// `out`, where `key_span` bytes may be read from the start of the last key
+template <class Layout>
+inline void _convert_keys(const char *keys, size_t stride, size_t num_keys,
+                          converted_t *out, size_t key_span) {
+  if constexpr (Layout::KEY_ENCODING == KeyEncoding::BINARY) {
+    _convert_binary_keys<Layout::NUM_CONVERTED_CHARS>(keys, stride, num_keys,
+                                                      out);
+  } else {
+    _convert_printable_keys<Layout::NUM_CONVERTED_CHARS>(keys, stride,
+                                                         num_keys, out,
+                                                         key_span);
+  }
+}
+
+// The key bytes past the converted ones, which break the ties between equal
+// converted keys
+template <class Layout>
+inline uint16_t _key_suffix(const char *key) {
+  uint16_t suffix = 0;
+  for (size_t i = Layout::NUM_CONVERTED_CHARS; i < Layout::KEY_SZ; ++i) {
+    suffix = suffix << 8 | static_cast<unsigned char>(key[i]);
+  }
+  return suffix;
+}
+
+}  // namespace internal
+}  // namespace elsar
@@ -0,0 +1,320 @@
+#pragma once
+
+#include <algorithm>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "../options.h"
+#include "../record_layout.h"
+#include "fragment_writer.h"
+#include "globals.h"
+#include "io.h"
+#include "lines.h"
+#include "partitioner.h"
+#include "tmp_roots.h"
+#include "utils.h"
+
+using namespace std;
+
+namespace elsar {
+namespace internal {
+
+// Streams the lines of a spilled partition of lines, fragment by fragment, to
+// `consume(line, len)`, where `len` includes the newline. Each read of up to
+// REPARTITION_BATCH_BYTES lands right after an aligned slack, which holds the
+// partial line carried over from the previous read, and grows with it.
+template <class Consumer>
+void _for_each_spilled_line(const spilled_partition &partition, IOQueue &io,
+                            Consumer consume) {
+  size_t slack = DIRECT_IO_ALIGNMENT;
+  char *buf = _alloc_aligned(slack + REPARTITION_BATCH_BYTES);
+
+  for (auto &frag : partition.fragments) {
+    size_t lines_left = frag.num_recs;
+    size_t carry = 0;
+    for (auto &extent : frag.extents) {
+      for (size_t off = 0; off < extent.length and lines_left > 0;) {
+        auto len = std::min(REPARTITION_BATCH_BYTES, extent.length - off);
+        io.read(frag.fd, buf + slack, len, extent.offset + off);
+        io.drain();
+        off += len;
+
+        const char *line = buf + slack - carry;
+        const char *end = buf + slack + len;
+        for (; lines_left > 0; --lines_left) {
+          auto newline =
+              static_cast<const char *>(memchr(line, '\n', end - line));
+          if (!newline) break;
+          consume(line, newline - line + 1);
+          line = newline + 1;
+        }
+        if (lines_left == 0) break; /* the rest is padding */
+
+        carry = end - line;
+        if (carry > slack) {
+          auto new_slack = _align_up(carry);
+          auto new_buf = _alloc_aligned(new_slack + REPARTITION_BATCH_BYTES);
+          memcpy(new_buf + new_slack - carry, line, carry);
+          free(buf);
+          buf = new_buf;
+          slack = new_slack;
+        } else {
+          memmove(buf + slack - carry, line, carry);
+        }
+      }
+    }
+  }
+  free(buf);
+}
+
+// Splits the partitions of lines that do not fit in the memory budget of the
+// sorters into pieces of about `piece_bytes` bytes on disk. The partitioner
+// only sees the first chunk of the keys, so the lines of an oversized
+// partition often share that chunk, such as a common timestamp prefix. They
+// are routed by exact pivots over their whole keys instead, picked from a
+// sample of the partition, recursively, until the pieces fit. Like in the
+// Repartitioner, the pieces whose lines all share the same key are copied
+// straight to their place in the output. Up to `num_concurrent_splits`
+// partitions may be split at once, and share the memory for staging and
+// sampling.
+class LineRepartitioner {
+ public:
+  LineRepartitioner(TmpRoots &tmp_roots, size_t mem_budget, size_t piece_bytes,
+                    int out_fd, const LineFormat &format,
+                    const Options &options, int num_concurrent_splits = 1)
+      : tmp_roots(tmp_roots),
+        mem_budget(mem_budget),
+        piece_bytes(piece_bytes),
+        out_fd(out_fd),
+        format(format),
+        options(options),
+        num_concurrent_splits(num_concurrent_splits),
+        num_spare_staging_bufs(
+            options.io_engine == IOEngine::IO_URING ? IO_QUEUE_DEPTH : 0),
+        staging_mem(STAGING_MEM_FRACTION * mem_budget /
+                    num_concurrent_splits),
+        sample_mem(READ_MEM_FRACTION * mem_budget / num_concurrent_splits) {}
+
+  // The temporary files hold the pieces until they have been sorted
+  ~LineRepartitioner() {
+    for (auto fd : tmp_fds) close(fd);
+  }
+
+  LineRepartitioner(const LineRepartitioner &) = delete;
+  LineRepartitioner &operator=(const LineRepartitioner &) = delete;
+
+  bool is_oversized(const spilled_partition &partition,
+                    size_t num_bytes) const {
+    return _line_partition_mem(num_bytes, partition.size) > mem_budget;
+  }
+
+  // Splits the oversized ones among `partitions`, whose sizes in bytes are
+  // `partition_bytes`, up to `num_concurrent_splits` at once. Both are
+  // replaced by the partitions that are left to write, in key order, with the
+  // pieces in place of the split ones. Empty partitions are dropped.
+  void split_oversized(vector<spilled_partition> &partitions,
+                       vector<size_t> &partition_bytes) {
+    vector<vector<spilled_partition>> split_pieces(partitions.size());
+    vector<vector<size_t>> split_piece_bytes(partitions.size());
+#pragma omp parallel for num_threads(num_concurrent_splits) schedule(dynamic)
+    for (size_t i = 0; i < partitions.size(); ++i) {
+      if (is_oversized(partitions[i], partition_bytes[i])) {
+        split(partitions[i], partition_bytes[i], split_pieces[i],
+              split_piece_bytes[i]);
+      }
+    }
+
+    vector<spilled_partition> pieces;
+    vector<size_t> piece_bytes;
+    for (size_t i = 0; i < partitions.size(); ++i) {
+      if (partitions[i].size == 0) continue;
+      if (is_oversized(partitions[i], partition_bytes[i])) {
+        for (size_t j = 0; j < split_pieces[i].size(); ++j) {
+          pieces.push_back(std::move(split_pieces[i][j]));
+          piece_bytes.push_back(split_piece_bytes[i][j]);
+        }
+      } else {
+        pieces.push_back(std::move(partitions[i]));
+        piece_bytes.push_back(partition_bytes[i]);
+      }
+    }
+    partitions = std::move(pieces);
+    partition_bytes = std::move(piece_bytes);
+  }
+
+  // Appends the pieces of the partition of `num_bytes` bytes that are left to
+  // write to `pieces`, in key order, along with their sizes in bytes. Pieces
+  // that cannot be split any further are appended even if they are still
+  // oversized.
+  void split(const spilled_partition &partition, size_t num_bytes,
+             vector<spilled_partition> &pieces, vector<size_t> &pieces_bytes,
+             int depth = 0) {
+    IOQueue read_io(options.io_engine);
+
+    //- - - - - - - - - - - - - - - - - - - - - - - - - - - -  -//
+    //               SAMPLE THE PARTITION'S KEYS                //
+    //- - - - - - - - - - - - - - - - - - - - - - - - - - - -  -//
+
+    // The whole keys are sampled at evenly spaced bytes, so that the pieces
+    // get about as many bytes as each other, within the memory for sampling
+    const size_t avg_line_bytes =
+        std::max<size_t>(1, num_bytes / partition.size);
+    const size_t num_samples = std::clamp<size_t>(
+        sample_mem / (sizeof(string) + avg_line_bytes), 1,
+        LINE_REPARTITION_SAMPLE_LINES);
+    const size_t sample_stride = std::max<size_t>(1, num_bytes / num_samples);
+    vector<string> sample;
+    sample.reserve(num_samples + 1);
+    size_t line_start = 0;
+    size_t next_sample_byte = 0;
+    _for_each_spilled_line(
+        partition, read_io, [&](const char *line, size_t len) {
+          if (line_start + len > next_sample_byte) {
+            size_t key_start, key_length;
+            _find_line_key(line, len - 1, format, key_start, key_length);
+            sample.emplace_back(line + key_start, key_length);
+            while (next_sample_byte < line_start + len) {
+              next_sample_byte += sample_stride;
+            }
+          }
+          line_start += len;
+        });
+
+    // As many pieces as the staging memory allows, when the partition is so
+    // large that it will take more than one more split
+    const size_t max_fanout =
+        std::max(staging_mem / MIN_STAGING_BYTES, num_spare_staging_bufs + 2) -
+        num_spare_staging_bufs;
+    const int num_pieces = std::clamp<size_t>(
+        (num_bytes + piece_bytes - 1) / piece_bytes, 2, max_fanout);
+    std::sort(sample.begin(), sample.end());
+    PivotPartitioner<string> partitioner(sample, num_pieces);
+    sample.clear();
+    sample.shrink_to_fit();
+
+    //- - - - - - - - - - - - - - - - - - - - - - - - - - - -  -//
+    //               SCATTER THE LINES INTO PIECES              //
+    //- - - - - - - - - - - - - - - - - - - - - - - - - - - -  -//
+
+    int fd = tmp_roots.open_tmp_file(options.direct_io);
+    {
+      lock_guard<mutex> lock(tmp_fds_mtx);
+      tmp_fds.push_back(fd);
+    }
+
+    const size_t staging_bytes = std::clamp(
+        _align_down(staging_mem / (num_pieces + num_spare_staging_bufs)),
+        MIN_STAGING_BYTES, MAX_STAGING_BYTES);
+
+    vector<spill_extent> extents;
+    vector<size_t> piece_sizes(num_pieces, 0);
+    vector<size_t> piece_bytes_written(num_pieces, 0);
+    vector<string> first_keys(num_pieces);
+    vector<bool> is_uniform(num_pieces, true);
+    {
+      IOQueue write_io(options.io_engine);
+      FragmentWriter fragment_writer(
+          fd, extents, piece_sizes.data(), num_pieces, staging_bytes, write_io,
+          options.direct_io);
+
+      _for_each_spilled_line(
+          partition, read_io, [&](const char *line, size_t len) {
+            size_t key_start, key_length;
+            _find_line_key(line, len - 1, format, key_start, key_length);
+            string_view key(line + key_start, key_length);
+            auto piece_idx = partitioner.predict(key);
+            if (piece_sizes[piece_idx] == 0) {
+              first_keys[piece_idx] = key;
+            } else if (is_uniform[piece_idx] and first_keys[piece_idx] != key) {
+              is_uniform[piece_idx] = false;
+            }
+            fragment_writer.append(piece_idx, line, len);
+            piece_bytes_written[piece_idx] += len;
+          });
+      fragment_writer.finish();
+    }
+    _release(partition);
+
+    //- - - - - - - - - - - - - - - - - - - - - - - - - - - -  -//
+    //                  FINALIZE OR SPLIT PIECES                //
+    //- - - - - - - - - - - - - - - - - - - - - - - - - - - -  -//
+
+    vector<spilled_partition> split_pieces(num_pieces);
+    size_t write_offset = partition.write_offset;
+    for (int piece_idx = 0; piece_idx < num_pieces; ++piece_idx) {
+      auto &piece = split_pieces[piece_idx];
+      piece.size = piece_sizes[piece_idx];
+      piece.write_offset = write_offset;
+      piece.fragments.push_back({fd, piece_sizes[piece_idx], {}});
+      write_offset += piece_bytes_written[piece_idx];
+    }
+    for (auto &extent : extents) {
+      split_pieces[extent.partition].fragments[0].extents.push_back(extent);
+    }
+
+    for (int piece_idx = 0; piece_idx < num_pieces; ++piece_idx) {
+      auto &piece = split_pieces[piece_idx];
+      auto bytes = piece_bytes_written[piece_idx];
+      if (piece.size == 0) continue;
+
+      if (is_uniform[piece_idx]) {
+        _copy_to_output(piece);
+      } else if (is_oversized(piece, bytes) and piece.size < partition.size and
+                 depth + 1 < MAX_REPARTITION_DEPTH) {
+        split(piece, bytes, pieces, pieces_bytes, depth + 1);
+      } else {
+        pieces.push_back(std::move(piece));
+        pieces_bytes.push_back(bytes);
+      }
+    }
+  }
+
+ private:
+  TmpRoots &tmp_roots;
+  const size_t mem_budget;
+  const size_t piece_bytes;
+  const int out_fd;
+  const LineFormat &format;
+  const Options &options;
+  const int num_concurrent_splits;
+  const size_t num_spare_staging_bufs;
+  const size_t staging_mem;
+  const size_t sample_mem;
+  mutex tmp_fds_mtx;
+  vector<int> tmp_fds;
+
+  // Gives the disk space of a consumed partition back
+  void _release(const spilled_partition &partition) {
+    for (auto &frag : partition.fragments) {
+      for (auto &extent : frag.extents) {
+        utils::_release_file_range(frag.fd, extent.offset, extent.length);
+      }
+    }
+  }
+
+  // Copies a partition whose lines all share the same key to the output, in
+  // writes of up to IO_CHUNK_BYTES
+  void _copy_to_output(const spilled_partition &partition) {
+    IOQueue io(options.io_engine);
+    size_t write_offset = partition.write_offset;
+    string batch;
+    auto flush_batch = [&]() {
+      _pwrite_fully(out_fd, batch.data(), batch.size(), write_offset);
+      write_offset += batch.size();
+      batch.clear();
+    };
+    _for_each_spilled_line(partition, io,
+                           [&](const char *line, size_t len) {
+                             batch.append(line, len);
+                             if (batch.size() >= IO_CHUNK_BYTES) flush_batch();
+                           });
+    flush_batch();
+    _release(partition);
+  }
+};
+
+}  // namespace internal
+}  // namespace elsar
@@ -0,0 +1,248 @@
+#pragma once
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#include "../record_layout.h"
+#include "embedding.h"
+#include "globals.h"
+#include "in_memory_sort.h"
+#include "io.h"
+#include "key_conversion.h"
+
+using namespace std;
+
+namespace elsar {
+namespace internal {
+
+// The keys of lines are converted in chunks of unsigned bytes, padded with
+// zeros past the end of the key. The first chunk routes the lines to their
+// partitions and sorts them, and the following ones only break the ties.
+using line_key_chunk = RecordLayout<10, 10, 0, KeyEncoding::BINARY>;
+static constexpr size_t LINE_KEY_CHUNK_BYTES = line_key_chunk::KEY_SZ;
+
+// A line of a loaded partition
+struct line_ref {
+  size_t offset;       /* bytes, in the partition buffer */
+  uint32_t length;     /* bytes, including the newline */
+  uint32_t key_start;  /* bytes, from the start of the line */
+  uint32_t key_length; /* bytes */
+};
+
+// The memory needed to load, sort and write a partition of lines
+inline size_t _line_partition_mem(size_t num_bytes, size_t num_lines) {
+  return num_bytes +
+         num_lines * (sizeof(line_ref) +
+                      sizeof(sort_entry) * IN_MEM_SORT_MEM_MULTIPLIER);
+}
+
+// Finds the key of a line of `line_len` bytes, without its newline
+inline void _find_line_key(const char *line, size_t line_len,
+                           const LineFormat &format, size_t &key_start,
+                           size_t &key_length) {
+  if (format.key_field < 0) {
+    key_start = 0;
+    key_length = line_len;
+    return;
+  }
+
+  key_start = 0;
+  for (int field_idx = 0; field_idx < format.key_field; ++field_idx) {
+    auto delim = static_cast<const char *>(
+        memchr(line + key_start, format.delimiter, line_len - key_start));
+    if (!delim) {
+      key_start = line_len;
+      key_length = 0;
+      return;
+    }
+    key_start = delim - line + 1;
+  }
+  auto delim = static_cast<const char *>(
+      memchr(line + key_start, format.delimiter, line_len - key_start));
+  key_length = (delim ? delim - line : line_len) - key_start;
+}
+
+// Converts the chunk of a key starting at its byte `chunk_start` into the
+// sort key of `entry`
+inline void _convert_key_chunk(const char *key, size_t key_length,
+                               size_t chunk_start, sort_entry &entry) {
+  char chunk[LINE_KEY_CHUNK_BYTES] = {0};
+  if (key_length > chunk_start) {
+    memcpy(chunk, key + chunk_start,
+           std::min(LINE_KEY_CHUNK_BYTES, key_length - chunk_start));
+  }
+  entry.converted_key = _convert_key<line_key_chunk>(chunk);
+  entry.key_suffix = _key_suffix<line_key_chunk>(chunk);
+}
+
+// Converts the first chunk of a key, which is all the partitioner needs
+inline converted_t _convert_key_prefix(const char *key, size_t key_length) {
+  sort_entry entry;
+  _convert_key_chunk(key, key_length, 0, entry);
+  return entry.converted_key;
+}
+
+// Orders lines whose keys are equal up to their byte `chunk_start`
+struct _line_key_less {
+  const char *records;
+  const line_ref *lines;
+  size_t chunk_start;
+
+  bool operator()(const sort_entry &a, const sort_entry &b) const {
+    auto &line_a = lines[a.record_idx];
+    auto &line_b = lines[b.record_idx];
+    auto len_a = line_a.key_length - std::min<size_t>(line_a.key_length,
+                                                      chunk_start);
+    auto len_b = line_b.key_length - std::min<size_t>(line_b.key_length,
+                                                      chunk_start);
+    int cmp = memcmp(
+        records + line_a.offset + line_a.key_start + chunk_start,
+        records + line_b.offset + line_b.key_start + chunk_start,
+        std::min(len_a, len_b));
+    return cmp < 0 or (cmp == 0 and len_a < len_b);
+  }
+};
+
+void _sort_line_ties(sort_entry *begin, sort_entry *end, const char *records,
+                     const line_ref *lines, size_t chunk_start);
+
+// Sorts lines whose keys are equal up to their byte `chunk_start`. Large runs
+// are sorted by the next chunk of their keys with the learned sort, and so on
+// until the keys run out.
+inline void _sort_tied_lines(sort_entry *begin, sort_entry *end,
+                             const char *records, const line_ref *lines,
+                             size_t chunk_start) {
+  // Skip the bytes shared by all the keys, such as a common timestamp prefix
+  auto key_of = [&](const sort_entry &entry) {
+    auto &line = lines[entry.record_idx];
+    return records + line.offset + line.key_start;
+  };
+  auto key_rest = [&](const sort_entry &entry) {
+    auto key_length = lines[entry.record_idx].key_length;
+    return key_length - std::min<size_t>(key_length, chunk_start);
+  };
+  const char *first_key = key_of(*begin) + chunk_start;
+  size_t common_bytes = key_rest(*begin);
+  for (auto it = begin + 1; it != end and common_bytes > 0; ++it) {
+    auto len = std::min(common_bytes, key_rest(*it));
+    auto key = key_of(*it) + chunk_start;
+    common_bytes = std::mismatch(first_key, first_key + len, key).first -
+                   first_key;
+  }
+  chunk_start += common_bytes;
+
+  bool keys_run_out = std::all_of(begin, end, [&](const sort_entry &entry) {
+    return lines[entry.record_idx].key_length <= chunk_start;
+  });
+  if (keys_run_out or std::distance(begin, end) <= LINE_TIE_SORT_THRESHOLD) {
+    // Keys only differ by their length (or their zero bytes) once they run out
+    std::sort(begin, end, _line_key_less{records, lines, chunk_start});
+    return;
+  }
+
+  for (auto it = begin; it != end; ++it) {
+    auto &line = lines[it->record_idx];
+    _convert_key_chunk(records + line.offset + line.key_start, line.key_length,
+                       chunk_start, *it);
+  }
+  in_memory_sort(begin, end, std::distance(begin, end));
+  _sort_line_ties(begin, end, records, lines,
+                  chunk_start + LINE_KEY_CHUNK_BYTES);
+}
+
+// Sorts the runs of entries sorted by the key chunk that ends at the byte
+// `chunk_start` of the keys, whose lines share that chunk
+void _sort_line_ties(sort_entry *begin, sort_entry *end, const char *records,
+                     const line_ref *lines, size_t chunk_start) {
+  for (auto run_begin = begin; run_begin < end;) {
+    auto run_end = run_begin + 1;
+    while (run_end < end and run_end->same_key(*run_begin)) ++run_end;
+    if (run_end - run_begin > 1) {
+      _sort_tied_lines(run_begin, run_end, records, lines, chunk_start);
+    }
+    run_begin = run_end;
+  }
+}
+
+// Returns the offset of the first line that starts at or after `offset`
+inline size_t _next_line_start(int fd, size_t offset, size_t file_sz) {
+  if (offset == 0 or offset >= file_sz) return std::min(offset, file_sz);
+
+  char buf[1 << 16];
+  for (size_t pos = offset - 1; pos < file_sz; pos += sizeof(buf)) {
+    auto len = std::min(sizeof(buf), file_sz - pos);
+    _pread_fully(fd, buf, len, pos);
+    auto newline = static_cast<char *>(memchr(buf, '\n', len));
+    if (newline) return pos + (newline - buf) + 1;
+  }
+  return file_sz;
+}
+
+// Samples the keys of the lines in blocks of LINE_SAMPLE_BLOCK_BYTES spread
+// evenly over the input, and converts their first chunk into `keys`. Only
+// the lines that start and end within a block are sampled. Returns the
+// average length of the sampled lines.
+double _sample_line_keys(int fd, size_t file_sz, const LineFormat &format,
+                         int num_threads, vector<converted_t> &keys) {
+  const size_t num_blocks = std::clamp<size_t>(
+      file_sz / LINE_SAMPLE_BLOCK_BYTES, 1, LINE_SAMPLE_BLOCKS);
+  const size_t block_stride = file_sz / num_blocks;
+
+  vector<vector<converted_t>> block_keys(num_blocks);
+  vector<size_t> block_line_bytes(num_blocks, 0);
+#pragma omp parallel num_threads(num_threads)
+  {
+    char *block_buf = new char[LINE_SAMPLE_BLOCK_BYTES];
+
+#pragma omp for
+    for (size_t block_idx = 0; block_idx < num_blocks; ++block_idx) {
+      const size_t block_start = block_idx * block_stride;
+      const size_t block_len =
+          std::min(LINE_SAMPLE_BLOCK_BYTES, file_sz - block_start);
+      _pread_fully(fd, block_buf, block_len, block_start);
+
+      // Skip the line cut by the start of the block
+      size_t pos = 0;
+      if (block_start > 0) {
+        auto newline =
+            static_cast<char *>(memchr(block_buf, '\n', block_len));
+        pos = newline ? newline - block_buf + 1 : block_len;
+      }
+      const bool reaches_eof = block_start + block_len == file_sz;
+      while (pos < block_len) {
+        auto line = block_buf + pos;
+        auto newline =
+            static_cast<char *>(memchr(line, '\n', block_len - pos));
+        if (!newline and !reaches_eof) break;
+        size_t line_len = newline ? newline - line : block_len - pos;
+
+        size_t key_start, key_length;
+        _find_line_key(line, line_len, format, key_start, key_length);
+        block_keys[block_idx].push_back(
+            _convert_key_prefix(line + key_start, key_length));
+        block_line_bytes[block_idx] += line_len + 1;
+        pos += line_len + 1;
+      }
+    }
+
+    delete[] block_buf;
+  }
+
+  size_t num_line_bytes = 0;
+  for (size_t block_idx = 0; block_idx < num_blocks; ++block_idx) {
+    keys.insert(keys.end(), block_keys[block_idx].begin(),
+                block_keys[block_idx].end());
+    num_line_bytes += block_line_bytes[block_idx];
+  }
+
+  // Without a single whole line in the sample, the lines are longer than the
+  // sample blocks
+  return keys.empty() ? LINE_SAMPLE_BLOCK_BYTES
+                      : 1. * num_line_bytes / keys.size();
+}
+
+}  // namespace internal
+}  // namespace elsar
@@ -0,0 +1,131 @@
+#pragma once
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <vector>
+
+#include "embedding.h"
+#include "globals.h"
+#include "key_conversion.h"
+#include "partitioner.h"
+#include "rmi.h"
+#include "utils.h"
+
+using namespace std;
+
+namespace elsar {
+namespace internal {
+
+// A model file holds the models trained over a sample of an input, so that
+// recurring jobs over a stable key distribution can skip sampling and
+// training. It is laid out as the magic bytes, the format version (u32), the
+// record layout the keys were converted with (4 x u32), the CDF of the
+// partitioner, and the model of the whole input when there is one, behind a
+// flag (u8).
+static constexpr char MODEL_FILE_MAGIC[8] = {'E', 'L', 'S', 'A',
+                                             'R', 'C', 'D', 'F'};
+static constexpr uint32_t MODEL_FILE_VERSION = 2;
+
+template <class Layout>
+inline void _write_model_layout(ostream &out) {
+  _write_pod(out, static_cast<uint32_t>(Layout::BYTES_PER_REC));
+  _write_pod(out, static_cast<uint32_t>(Layout::KEY_SZ));
+  _write_pod(out, static_cast<uint32_t>(Layout::KEY_OFFSET));
+  _write_pod(out, static_cast<uint32_t>(Layout::KEY_ENCODING));
+}
+
+template <class Layout>
+inline bool _check_model_layout(istream &in) {
+  uint32_t fields[4];
+  for (auto &field : fields) {
+    if (!_read_pod(in, field)) return false;
+  }
+  return fields[0] == Layout::BYTES_PER_REC and fields[1] == Layout::KEY_SZ and
+         fields[2] == Layout::KEY_OFFSET and
+         fields[3] == static_cast<uint32_t>(Layout::KEY_ENCODING);
+}
+
+// Writes the trained models to the file at `path`
+template <class Layout>
+void _save_models(const char *path, const LearnedPartitioner &partitioner,
+                  const TwoLayerRMI &input_rmi) {
+  ofstream out(path, ios::binary | ios::trunc);
+  out.write(MODEL_FILE_MAGIC, sizeof(MODEL_FILE_MAGIC));
+  _write_pod(out, MODEL_FILE_VERSION);
+  _write_model_layout<Layout>(out);
+  partitioner.save(out);
+  _write_pod(out, static_cast<uint8_t>(input_rmi.trained));
+  if (input_rmi.trained) input_rmi.save(out);
+
+  if (!out) {
+    cerr << "\33[93;1mWARNING\33[0m: Could not save the models to " << path
+         << "." << endl;
+  }
+}
+
+// Reads the models from the file at `path`, keeping the number of partitions
+// of `partitioner`. Leaves the models untouched and returns false when the
+// file cannot be read or was written for another record layout.
+template <class Layout>
+bool _load_models(const char *path, LearnedPartitioner &partitioner,
+                  TwoLayerRMI &input_rmi) {
+  ifstream in(path, ios::binary);
+  char magic[sizeof(MODEL_FILE_MAGIC)];
+  uint32_t version;
+  LearnedPartitioner loaded_partitioner(partitioner.num_partitions);
+  TwoLayerRMI loaded_rmi;
+  uint8_t has_input_rmi;
+  const bool ok =
+      in.read(magic, sizeof(magic)) and
+      memcmp(magic, MODEL_FILE_MAGIC, sizeof(magic)) == 0 and
+      _read_pod(in, version) and version == MODEL_FILE_VERSION and
+      _check_model_layout<Layout>(in) and loaded_partitioner.load(in) and
+      _read_pod(in, has_input_rmi) and
+      (!has_input_rmi or loaded_rmi.load(in));
+  if (!ok) {
+    cerr << "\33[93;1mWARNING\33[0m: Could not load the models from " << path
+         << ". Training new ones." << endl;
+    return false;
+  }
+
+  partitioner = loaded_partitioner;
+  input_rmi = loaded_rmi;
+  return true;
+}
+
+// Estimates how far the key distribution of an input has drifted from the
+// CDF learned by the partitioner, as the largest gap between the predicted
+// CDF of a small sample of keys and their empirical CDF. Ties span a range of
+// the empirical CDF, and any prediction within it is exact.
+template <class Layout>
+double _model_drift(const LearnedPartitioner &partitioner,
+                    const char *input_file, size_t num_recs,
+                    int num_threads) {
+  const size_t sample_sz = std::min(num_recs, DRIFT_CHECK_SAMPLE_RECS);
+  if (sample_sz == 0) return 0;
+  vector<char> sample_keys(sample_sz * Layout::KEY_SZ);
+  auto num_sampled = utils::_sample_keys_from_file<Layout>(
+      input_file, num_recs, sample_sz, sample_keys.data(), num_threads);
+
+  vector<converted_t> keys(num_sampled);
+  _convert_keys<Layout>(sample_keys.data(), Layout::KEY_SZ, num_sampled,
+                        keys.data(), Layout::KEY_SZ);
+  std::sort(keys.begin(), keys.end());
+
+  double drift = 0;
+  for (size_t run_begin = 0; run_begin < num_sampled;) {
+    size_t run_end = run_begin + 1;
+    while (run_end < num_sampled and keys[run_end] == keys[run_begin]) {
+      ++run_end;
+    }
+    const double pred_cdf = partitioner.predict_cdf(keys[run_begin]);
+    drift = std::max({drift, 1. * run_begin / num_sampled - pred_cdf,
+                      pred_cdf - 1. * run_end / num_sampled});
+    run_begin = run_end;
+  }
+  return drift;
+}
+
+}  // namespace internal
+}  // namespace elsar
@@ -0,0 +1,203 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "embedding.h"
+#include "globals.h"
+#include "rmi.h"
+
+using namespace std;
+
+namespace elsar {
+namespace internal {
+
+// Routes records to equi-depth external partitions using the CDF learned by a
+// TwoLayerRMI over a sample of the input.
+//
+// Unlike the in-memory sorter, which fixes mispredictions with a final
+// touch-up pass, the external partitioner MUST be monotone: a record with a
+// smaller key can never be routed to a later partition. The raw RMI does not
+// guarantee this around leaf boundaries, so each leaf's prediction is clamped
+// to the CDF range spanned by its own training points.
+class LearnedPartitioner {
+ public:
+  int num_partitions;
+
+  // Until trained, every record is routed to the first partition
+  LearnedPartitioner(int num_partitions)
+      : num_partitions(num_partitions),
+        degenerate(true),
+        pivot_key(~static_cast<converted_t>(0)) {}
+
+  // Trains the partitioner over the sampled keys. The `record` field of the
+  // embeddings only needs to point to the key. The learned CDF does not
+  // depend on the number of partitions, so a single partition is trained too,
+  // for the model to be saved.
+  void train(Embedding *begin, Embedding *end) {
+    const long sample_sz = std::distance(begin, end);
+    if (sample_sz == 0) return;
+
+    auto minmax =
+        std::minmax_element(begin, end, [](const auto &a, const auto &b) {
+          return a.converted_key < b.converted_key;
+        });
+    if (minmax.first->converted_key == minmax.second->converted_key) {
+      // All the sampled keys are identical: keep them in the first partition
+      // and send anything larger to the last one
+      pivot_key = minmax.first->converted_key;
+      return;
+    }
+
+    // Fanout and threshold only matter to the in-memory sorter. Train over
+    // the entire sample, since it has already been drawn from the input.
+    TwoLayerRMI::Params p(1., 1, 1);
+    rmi = TwoLayerRMI(p);
+    rmi.train(begin, end);
+    degenerate = false;
+
+    // Collect the CDF range covered by each leaf's training points
+    const long num_leaf_models = rmi.hp.num_leaf_models;
+    vector<double> last_cdf(num_leaf_models, -1.);
+    for (long i = 0; i < sample_sz; ++i) {
+      auto leaf_idx = _predict_leaf(rmi.training_sample[i]);
+      last_cdf[leaf_idx] = 1. * i / sample_sz;
+    }
+    rmi.training_sample.clear();
+    rmi.training_sample.shrink_to_fit();
+
+    leaf_min_cdf.resize(num_leaf_models);
+    leaf_max_cdf.resize(num_leaf_models);
+    double running_cdf = 0;
+    for (long leaf_idx = 0; leaf_idx < num_leaf_models; ++leaf_idx) {
+      leaf_min_cdf[leaf_idx] = running_cdf;
+      running_cdf = std::max(running_cdf, last_cdf[leaf_idx]);
+      leaf_max_cdf[leaf_idx] = running_cdf;
+    }
+    leaf_max_cdf[num_leaf_models - 1] = 1.;
+  }
+
+  // Predicts the partition of a converted key
+  inline int predict(converted_t key) const {
+    if (degenerate) {
+      return key <= pivot_key ? 0 : num_partitions - 1;
+    }
+
+    return std::min(num_partitions - 1,
+                    static_cast<int>(predict_cdf(key) * num_partitions));
+  }
+
+  // Predicts the CDF of a converted key, which is monotone in the key
+  inline double predict_cdf(converted_t key) const {
+    if (degenerate) return key <= pivot_key ? 0. : 1.;
+
+    auto leaf_idx = _predict_leaf(key);
+    double pred_cdf = rmi.leaf_models[leaf_idx].slope * key +
+                      rmi.leaf_models[leaf_idx].intercept;
+
+    // NaN shows up when a leaf was fitted over identical keys
+    if (!(pred_cdf >= leaf_min_cdf[leaf_idx])) {
+      pred_cdf = leaf_min_cdf[leaf_idx];
+    } else if (pred_cdf > leaf_max_cdf[leaf_idx]) {
+      pred_cdf = leaf_max_cdf[leaf_idx];
+    }
+    return pred_cdf;
+  }
+
+  // Serializes the learned CDF, which any number of partitions can reuse
+  void save(ostream &out) const {
+    _write_pod(out, static_cast<uint8_t>(degenerate));
+    _write_pod(out, pivot_key);
+    if (degenerate) return;
+    rmi.save(out);
+    out.write(reinterpret_cast<const char *>(leaf_min_cdf.data()),
+              leaf_min_cdf.size() * sizeof(double));
+    out.write(reinterpret_cast<const char *>(leaf_max_cdf.data()),
+              leaf_max_cdf.size() * sizeof(double));
+  }
+
+  // Reads a CDF serialized by save(), keeping the number of partitions.
+  // Returns false on a truncated or malformed input.
+  bool load(istream &in) {
+    uint8_t is_degenerate;
+    if (!_read_pod(in, is_degenerate) or !_read_pod(in, pivot_key)) {
+      return false;
+    }
+    degenerate = is_degenerate;
+    if (degenerate) return true;
+
+    if (!rmi.load(in)) return false;
+    leaf_min_cdf.resize(rmi.hp.num_leaf_models);
+    leaf_max_cdf.resize(rmi.hp.num_leaf_models);
+    return static_cast<bool>(
+               in.read(reinterpret_cast<char *>(leaf_min_cdf.data()),
+                       leaf_min_cdf.size() * sizeof(double))) and
+           static_cast<bool>(
+               in.read(reinterpret_cast<char *>(leaf_max_cdf.data()),
+                       leaf_max_cdf.size() * sizeof(double)));
+  }
+
+ private:
+  TwoLayerRMI rmi;
+  vector<double> leaf_min_cdf;
+  vector<double> leaf_max_cdf;
+  bool degenerate;
+  converted_t pivot_key;
+
+  // Routes like TwoLayerRMI::train() so that keys land in the same leaf they
+  // were trained in
+  inline long _predict_leaf(converted_t key) const { return rmi.leaf_of(key); }
+};
+
+// Routes records to partitions by exact pivots over their full keys, in the
+// order of `Key`: the converted key and its suffix for records, or all the
+// bytes of the key for lines. It is the fallback for the keys that the CDF
+// cannot tell apart, such as a few heavy values that only differ past the
+// precision of a double. Each heavy key gets a partition of its own.
+template <class Key = sort_entry>
+class PivotPartitioner {
+ public:
+  // Picks the pivots out of the sorted full keys of a sample. A partition is
+  // closed once it holds its share of the sample, and before and after any key
+  // that fills a share on its own. The last partition takes the rest.
+  PivotPartitioner(const vector<Key> &sorted_keys, int num_partitions) {
+    const long sample_sz = sorted_keys.size();
+    const double share = 1. * sample_sz / num_partitions;
+    const size_t max_pivots = num_partitions - 1;
+    long partition_sz = 0;
+    for (long run_start = 0;
+         run_start < sample_sz and pivots.size() < max_pivots;) {
+      long run_end = run_start + 1;
+      while (run_end < sample_sz and
+             !(sorted_keys[run_start] < sorted_keys[run_end])) {
+        ++run_end;
+      }
+      if (run_end - run_start >= share and partition_sz > 0) {
+        pivots.push_back(sorted_keys[run_start - 1]);
+        partition_sz = 0;
+        if (pivots.size() == max_pivots) break;
+      }
+      partition_sz += run_end - run_start;
+      if (partition_sz >= share) {
+        pivots.push_back(sorted_keys[run_end - 1]);
+        partition_sz = 0;
+      }
+      run_start = run_end;
+    }
+  }
+
+  // Predicts the partition of a full key: the first one whose pivot, its
+  // largest key, is not smaller
+  template <class Probe>
+  inline int predict(const Probe &key) const {
+    return std::lower_bound(pivots.begin(), pivots.end(), key) -
+           pivots.begin();
+  }
+
+ private:
+  vector<Key> pivots;
+};
+
+}  // namespace internal
+}  // namespace elsar
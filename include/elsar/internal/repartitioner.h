@@ -0,0 +1,326 @@
+#pragma once
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "../options.h"
+#include "embedding.h"
+#include "fragment_writer.h"
+#include "globals.h"
+#include "io.h"
+#include "key_conversion.h"
+#include "partitioner.h"
+#include "sorter_scheduler.h"
+#include "tmp_roots.h"
+#include "utils.h"
+
+using namespace std;
+
+namespace elsar {
+namespace internal {
+
+// Streams the records of a spilled partition, fragment by fragment, to
+// `consume(recs, num_recs)` in batches of up to REPARTITION_BATCH_BYTES. Each
+// read lands right after an aligned slack as large as a record, which holds the
+// partial record carried over from the previous read.
+template <class Layout, class Consumer>
+void _for_each_spilled_batch(const spilled_partition &partition, IOQueue &io,
+                             Consumer consume) {
+  const size_t slack = _align_up(Layout::BYTES_PER_REC);
+  char *buf = _alloc_aligned(slack + REPARTITION_BATCH_BYTES);
+  char *read_start = buf + slack;
+
+  for (auto &frag : partition.fragments) {
+    size_t recs_left = frag.num_recs;
+    size_t carry = 0;
+    for (auto &extent : frag.extents) {
+      for (size_t off = 0; off < extent.length and recs_left > 0;) {
+        auto len = std::min(REPARTITION_BATCH_BYTES, extent.length - off);
+        io.read(frag.fd, read_start, len, extent.offset + off);
+        io.drain();
+        off += len;
+
+        auto recs = read_start - carry;
+        auto num_recs =
+            std::min(recs_left, (carry + len) / Layout::BYTES_PER_REC);
+        if (num_recs > 0) consume(recs, num_recs);
+        recs_left -= num_recs;
+        if (recs_left == 0) break; /* the rest is padding */
+
+        auto consumed = num_recs * Layout::BYTES_PER_REC;
+        carry = carry + len - consumed;
+        memmove(read_start - carry, recs + consumed, carry);
+      }
+    }
+  }
+  free(buf);
+}
+
+// Splits the partitions that do not fit in the memory budget of the sorters
+// into pieces of up to `piece_recs` records on disk. An oversized partition is
+// sampled, and then scattered into a new temporary file by a partitioner
+// trained on its own sample, recursively, until its pieces fit. The pieces
+// whose records all share the same key need no sorting, so they are copied
+// straight to their place in the output, or returned as in order when there
+// is no output file to copy them to (`out_fd` < 0). Up to
+// `num_concurrent_splits` partitions may be split at once, and share the
+// memory for staging.
+template <class Layout>
+class Repartitioner {
+ public:
+  Repartitioner(TmpRoots &tmp_roots, size_t mem_budget, size_t piece_recs,
+                int out_fd, const Options &options,
+                int num_concurrent_splits = 1)
+      : tmp_roots(tmp_roots),
+        mem_budget(mem_budget),
+        piece_recs(piece_recs),
+        out_fd(out_fd),
+        options(options),
+        num_concurrent_splits(num_concurrent_splits),
+        num_spare_staging_bufs(
+            options.io_engine == IOEngine::IO_URING ? IO_QUEUE_DEPTH : 0),
+        staging_mem(STAGING_MEM_FRACTION * mem_budget /
+                    num_concurrent_splits) {}
+
+  // The temporary files hold the pieces until they have been sorted
+  ~Repartitioner() {
+    for (auto fd : tmp_fds) close(fd);
+  }
+
+  Repartitioner(const Repartitioner &) = delete;
+  Repartitioner &operator=(const Repartitioner &) = delete;
+
+  bool is_oversized(const spilled_partition &partition) const {
+    return _partition_mem<Layout>(partition.size) > mem_budget;
+  }
+
+  // Splits the oversized ones among `partitions`, up to
+  // `num_concurrent_splits` at once, and returns the partitions that are left
+  // to write, in key order, with the pieces in place of the split ones. Empty
+  // partitions are dropped.
+  vector<spilled_partition> split_oversized(
+      vector<spilled_partition> &partitions) {
+    vector<vector<spilled_partition>> split_pieces(partitions.size());
+#pragma omp parallel for num_threads(num_concurrent_splits) schedule(dynamic)
+    for (size_t i = 0; i < partitions.size(); ++i) {
+      if (is_oversized(partitions[i])) split_pieces[i] = split(partitions[i]);
+    }
+
+    vector<spilled_partition> pieces;
+    for (size_t i = 0; i < partitions.size(); ++i) {
+      if (partitions[i].size == 0) continue;
+      if (is_oversized(partitions[i])) {
+        for (auto &piece : split_pieces[i]) pieces.push_back(std::move(piece));
+      } else {
+        pieces.push_back(std::move(partitions[i]));
+      }
+    }
+    return pieces;
+  }
+
+  // Returns the pieces of the partition that are left to write, in key order.
+  // Pieces that cannot be split any further are returned even if they are
+  // still oversized.
+  vector<spilled_partition> split(const spilled_partition &partition,
+                                  int depth = 0) {
+    IOQueue read_io(options.io_engine);
+
+    //- - - - - - - - - - - - - - - - - - - - - - - - - - - -  -//
+    //               TRAIN ON THE PARTITION'S KEYS              //
+    //- - - - - - - - - - - - - - - - - - - - - - - - - - - -  -//
+
+    const size_t sample_stride =
+        std::max<size_t>(1, partition.size / TRAINING_SAMPLE_RECS);
+    vector<Embedding> sample;
+    vector<uint16_t> sample_suffixes;
+    sample.reserve(partition.size / sample_stride + 1);
+    sample_suffixes.reserve(sample.capacity());
+    size_t next_rec_idx = 0;
+    size_t next_sample_idx = 0;
+    _for_each_spilled_batch<Layout>(
+        partition, read_io, [&](const char *recs, size_t num_recs) {
+          for (; next_sample_idx < next_rec_idx + num_recs;
+               next_sample_idx += sample_stride) {
+            auto rec = recs + (next_sample_idx - next_rec_idx) *
+                                  Layout::BYTES_PER_REC;
+            sample.emplace_back(
+                nullptr, _convert_key<Layout>(rec + Layout::KEY_OFFSET));
+            sample_suffixes.push_back(
+                _key_suffix<Layout>(rec + Layout::KEY_OFFSET));
+          }
+          next_rec_idx += num_recs;
+        });
+
+    // As many pieces as the staging memory allows, when the partition is so
+    // large that it will take more than one more split
+    const size_t max_fanout =
+        std::max(staging_mem / MIN_STAGING_BYTES, num_spare_staging_bufs + 2) -
+        num_spare_staging_bufs;
+    const int num_pieces = std::clamp<size_t>(
+        (partition.size + piece_recs - 1) / piece_recs, 2, max_fanout);
+    LearnedPartitioner partitioner(num_pieces);
+    partitioner.train(sample.data(), sample.data() + sample.size());
+
+    // When the learned CDF would leave most of the sample in a single piece,
+    // its keys are too close for a double to tell apart. The pieces are then
+    // split at exact pivots instead, so that such heavy keys end up alone in
+    // uniform pieces.
+    vector<long> sampled_piece_sizes(num_pieces, 0);
+    for (auto &embedding : sample) {
+      ++sampled_piece_sizes[partitioner.predict(embedding.converted_key)];
+    }
+    const long max_sampled_piece_sz = *std::max_element(
+        sampled_piece_sizes.begin(), sampled_piece_sizes.end());
+    unique_ptr<PivotPartitioner<>> pivot_partitioner;
+    if (max_sampled_piece_sz >=
+        std::max<long>(sample.size() / 2, 2 * sample.size() / num_pieces)) {
+      vector<sort_entry> sorted_keys(sample.size());
+      for (size_t i = 0; i < sample.size(); ++i) {
+        sorted_keys[i] = {sample[i].converted_key, 0, sample_suffixes[i]};
+      }
+      std::sort(sorted_keys.begin(), sorted_keys.end());
+      pivot_partitioner =
+          make_unique<PivotPartitioner<>>(sorted_keys, num_pieces);
+    }
+    sample.clear();
+    sample.shrink_to_fit();
+    sample_suffixes.clear();
+    sample_suffixes.shrink_to_fit();
+
+    //- - - - - - - - - - - - - - - - - - - - - - - - - - - -  -//
+    //              SCATTER THE RECORDS INTO PIECES             //
+    //- - - - - - - - - - - - - - - - - - - - - - - - - - - -  -//
+
+    int fd = tmp_roots.open_tmp_file(options.direct_io);
+    {
+      lock_guard<mutex> lock(tmp_fds_mtx);
+      tmp_fds.push_back(fd);
+    }
+
+    const size_t staging_bytes = std::clamp(
+        _align_down(staging_mem / (num_pieces + num_spare_staging_bufs)),
+        MIN_STAGING_BYTES, MAX_STAGING_BYTES);
+
+    vector<spill_extent> extents;
+    vector<size_t> piece_sizes(num_pieces, 0);
+    vector<char> first_keys(num_pieces * Layout::KEY_SZ);
+    vector<bool> is_uniform(num_pieces, true);
+    {
+      IOQueue write_io(options.io_engine);
+      FragmentWriter fragment_writer(
+          fd, extents, piece_sizes.data(), num_pieces, staging_bytes, write_io,
+          options.direct_io);
+
+      converted_t converted_keys[CONVERT_BATCH_RECS];
+      _for_each_spilled_batch<Layout>(
+          partition, read_io, [&](const char *recs, size_t num_recs) {
+            for (size_t block_start = 0; block_start < num_recs;
+                 block_start += CONVERT_BATCH_RECS) {
+              const size_t block_sz =
+                  std::min(CONVERT_BATCH_RECS, num_recs - block_start);
+              const char *block_recs =
+                  recs + block_start * Layout::BYTES_PER_REC;
+              utils::_convert_record_keys<Layout>(block_recs, block_sz,
+                                                  converted_keys);
+
+              for (size_t i = 0; i < block_sz; ++i) {
+                auto rec = block_recs + i * Layout::BYTES_PER_REC;
+                auto key = rec + Layout::KEY_OFFSET;
+                auto piece_idx =
+                    pivot_partitioner
+                        ? pivot_partitioner->predict(sort_entry{
+                              converted_keys[i], 0, _key_suffix<Layout>(key)})
+                        : partitioner.predict(converted_keys[i]);
+                auto first_key = first_keys.data() + piece_idx * Layout::KEY_SZ;
+                if (piece_sizes[piece_idx] == 0) {
+                  memcpy(first_key, key, Layout::KEY_SZ);
+                } else if (is_uniform[piece_idx] and
+                           memcmp(first_key, key, Layout::KEY_SZ) != 0) {
+                  is_uniform[piece_idx] = false;
+                }
+                fragment_writer.append(piece_idx, rec, Layout::BYTES_PER_REC);
+              }
+            }
+          });
+      fragment_writer.finish();
+    }
+    _release(partition);
+
+    //- - - - - - - - - - - - - - - - - - - - - - - - - - - -  -//
+    //                  FINALIZE OR SPLIT PIECES                //
+    //- - - - - - - - - - - - - - - - - - - - - - - - - - - -  -//
+
+    vector<spilled_partition> pieces(num_pieces);
+    size_t write_offset = partition.write_offset;
+    for (int piece_idx = 0; piece_idx < num_pieces; ++piece_idx) {
+      pieces[piece_idx].size = piece_sizes[piece_idx];
+      pieces[piece_idx].write_offset = write_offset;
+      pieces[piece_idx].fragments.push_back({fd, piece_sizes[piece_idx], {}});
+      write_offset += piece_sizes[piece_idx] * Layout::BYTES_PER_REC;
+    }
+    for (auto &extent : extents) {
+      pieces[extent.partition].fragments[0].extents.push_back(extent);
+    }
+
+    vector<spilled_partition> pieces_to_sort;
+    for (int piece_idx = 0; piece_idx < num_pieces; ++piece_idx) {
+      auto &piece = pieces[piece_idx];
+      if (piece.size == 0) continue;
+
+      if (is_uniform[piece_idx] and out_fd >= 0) {
+        _copy_to_output(piece);
+      } else if (is_uniform[piece_idx]) {
+        piece.in_order = true;
+        pieces_to_sort.push_back(std::move(piece));
+      } else if (is_oversized(piece) and piece.size < partition.size and
+                 depth + 1 < MAX_REPARTITION_DEPTH) {
+        for (auto &sub_piece : split(piece, depth + 1)) {
+          pieces_to_sort.push_back(std::move(sub_piece));
+        }
+      } else {
+        pieces_to_sort.push_back(std::move(piece));
+      }
+    }
+    return pieces_to_sort;
+  }
+
+ private:
+  TmpRoots &tmp_roots;
+  const size_t mem_budget;
+  const size_t piece_recs;
+  const int out_fd;
+  const Options &options;
+  const int num_concurrent_splits;
+  const size_t num_spare_staging_bufs;
+  const size_t staging_mem;
+  mutex tmp_fds_mtx;
+  vector<int> tmp_fds;
+
+  // Gives the disk space of a consumed partition back
+  void _release(const spilled_partition &partition) {
+    for (auto &frag : partition.fragments) {
+      for (auto &extent : frag.extents) {
+        utils::_release_file_range(frag.fd, extent.offset, extent.length);
+      }
+    }
+  }
+
+  // Copies a partition whose records are already in order to the output
+  void _copy_to_output(const spilled_partition &partition) {
+    IOQueue io(options.io_engine);
+    size_t write_offset = partition.write_offset;
+    _for_each_spilled_batch<Layout>(
+        partition, io, [&](const char *recs, size_t num_recs) {
+          _pwrite_fully(out_fd, recs, num_recs * Layout::BYTES_PER_REC,
+                        write_offset);
+          write_offset += num_recs * Layout::BYTES_PER_REC;
+        });
+    _release(partition);
+  }
+};
+
+}  // namespace internal
+}  // namespace elsar
@@ -1,8 +1,20 @@
 #pragma once
 
+#include <algorithm>
+#include <bit>
+#include <cstring>
 #include <iostream>
+#include <istream>
+#include <iterator>
+#include <ostream>
 #include <vector>
 
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "embedding.h"
+
 using namespace std;
 
 namespace elsar {
@@ -14,13 +26,26 @@ struct training_point {
   double y;
 };
 
+// Writes and reads the plain fields of the serialized models
+template <typename T>
+inline void _write_pod(ostream &out, const T &value) {
+  out.write(reinterpret_cast<const char *>(&value), sizeof(T));
+}
+
+template <typename T>
+inline bool _read_pod(istream &in, T &value) {
+  return static_cast<bool>(
+      in.read(reinterpret_cast<char *>(&value), sizeof(T)));
+}
+
 // Represents linear models
 struct linear_model {
   double slope = 0;
   double intercept = 0;
 };
 
-// An implementation of a 2-layer RMI model
+// An implementation of a 2-layer RMI model, with an optional inner layer that
+// turns it into a 3-layer one
 class TwoLayerRMI {
  public:
   // CDF model hyperparameters
@@ -30,13 +55,20 @@ class TwoLayerRMI {
     float sampling_rate;
     long threshold;
     long num_leaf_models;
+    long num_inner_models; /* 0 for two layers only */
 
     // Default hyperparameters
     static constexpr long DEFAULT_FANOUT = 1e3;
     static constexpr float DEFAULT_SAMPLING_RATE = .1;
     static constexpr long DEFAULT_THRESHOLD = 100;
-    static constexpr long DEFAULT_NUM_LEAF_MODELS = 1000;
+    static constexpr long DEFAULT_NUM_LEAF_MODELS =
+        DEFAULT_RMI_ARCH[std::size(DEFAULT_RMI_ARCH) - 1];
+    static constexpr long DEFAULT_NUM_INNER_MODELS =
+        std::size(DEFAULT_RMI_ARCH) > 2 ? DEFAULT_RMI_ARCH[1] : 0;
     static constexpr long MIN_SORTING_SIZE = 1e4;
+    static constexpr long MIN_SLICE_LEAVES = 100;
+    static constexpr long MAX_SLICE_LEAVES = 4 * DEFAULT_NUM_LEAF_MODELS;
+    static constexpr double MIN_INNER_LAYER_GAIN = 2;
 
     // Default constructor
     Params() {
@@ -44,22 +76,29 @@ class TwoLayerRMI {
       this->sampling_rate = DEFAULT_SAMPLING_RATE;
       this->threshold = DEFAULT_THRESHOLD;
       this->num_leaf_models = DEFAULT_NUM_LEAF_MODELS;
+      this->num_inner_models = DEFAULT_NUM_INNER_MODELS;
     }
 
-    // Constructor with custom hyperparameter values
+    // Constructor with custom hyperparameter values. The models stay two
+    // layers deep, which keeps them monotone and sliceable.
     Params(float sampling_rate, long fanout, long threshold) {
       this->fanout = fanout;
       this->sampling_rate = sampling_rate;
       this->threshold = threshold;
       this->num_leaf_models = DEFAULT_NUM_LEAF_MODELS;
+      this->num_inner_models = 0;
     }
   };
 
+  // Bounds the allocation made for a serialized model
+  static constexpr long MAX_SERIALIZED_LEAVES = 1l << 28;
+
   // Member variables of the CDF model
   bool trained;
   linear_model root_model;
+  vector<linear_model> inner_models; /* empty for two layers */
   vector<linear_model> leaf_models;
-  vector<Embedding> training_sample;
+  vector<converted_t> training_sample;
   Params hp;
   bool enable_dups_detection;
 
@@ -83,19 +122,38 @@ class TwoLayerRMI {
   void print() {
     printf("[0][0]: slope=%.2e; intercept=%0.2e;\n", root_model.slope,
            root_model.intercept);
+    const int leaf_layer = inner_models.empty() ? 1 : 2;
+    for (size_t model_idx = 0; model_idx < inner_models.size(); ++model_idx) {
+      printf("[%zu][1]: slope=%.2e; intercept=%0.2e;\n", model_idx,
+             inner_models[model_idx].slope, inner_models[model_idx].intercept);
+    }
     for (int model_idx = 0; model_idx < hp.num_leaf_models; ++model_idx) {
-      printf("[%i][1]: slope=%.2e; intercept=%0.2e;\n", model_idx,
+      printf("[%i][%i]: slope=%.2e; intercept=%0.2e;\n", model_idx, leaf_layer,
              leaf_models[model_idx].slope, leaf_models[model_idx].intercept);
     }
     cout << "-----------------------------" << endl;
   }
 
+  // Predicts the leaf model of a key, through the inner layer if there is one
+  inline long leaf_of(converted_t key) const {
+    double rank = root_model.slope * key + root_model.intercept;
+    if (!inner_models.empty()) {
+      auto &inner = inner_models[_clamp_rank(rank, inner_models.size())];
+      rank = hp.num_leaf_models * (inner.slope * key + inner.intercept);
+    }
+    return _clamp_rank(rank, hp.num_leaf_models);
+  }
+
+  // Predicts the CDF of the keys of a block of entries into `cdfs`, with the
+  // widest vector kernel supported by the CPU. A key gets the same prediction
+  // whatever its position in a block, so predicting a single entry agrees with
+  // predicting it among others.
+  void predict_cdfs(const sort_entry *entries, size_t num_entries,
+                    double *cdfs) const;
+
   template <class S, class K>
   S predict(K key, S scale) {
-    int predicted_leaf_model =
-        std::max(0, std::min<int>(hp.num_leaf_models - 1,
-                                  static_cast<int>(root_model.slope * key +
-                                                   root_model.intercept)));
+    long predicted_leaf_model = leaf_of(key);
     S predicted_scaled_cdf = std::max(
         static_cast<S>(0),
         std::min(
@@ -107,7 +165,95 @@ class TwoLayerRMI {
     return predicted_scaled_cdf;
   }
 
-  bool train(Embedding *begin, Embedding *end) {
+  // Serializes the hyperparameters and the weights of a trained model. The
+  // training sample is not part of it.
+  void save(ostream &out) const {
+    _write_pod(out, hp.fanout);
+    _write_pod(out, hp.sampling_rate);
+    _write_pod(out, hp.threshold);
+    _write_pod(out, hp.num_leaf_models);
+    _write_pod(out, root_model);
+    _write_pod(out, static_cast<long>(inner_models.size()));
+    out.write(reinterpret_cast<const char *>(inner_models.data()),
+              inner_models.size() * sizeof(linear_model));
+    out.write(reinterpret_cast<const char *>(leaf_models.data()),
+              leaf_models.size() * sizeof(linear_model));
+  }
+
+  // Reads a model serialized by save(). Returns false on a truncated or
+  // malformed input.
+  bool load(istream &in) {
+    if (!_read_pod(in, hp.fanout) or !_read_pod(in, hp.sampling_rate) or
+        !_read_pod(in, hp.threshold) or !_read_pod(in, hp.num_leaf_models) or
+        !_read_pod(in, root_model) or hp.num_leaf_models <= 0 or
+        hp.num_leaf_models > MAX_SERIALIZED_LEAVES) {
+      return false;
+    }
+    long num_inner_models;
+    if (!_read_pod(in, num_inner_models) or num_inner_models < 0 or
+        num_inner_models > MAX_SERIALIZED_LEAVES) {
+      return false;
+    }
+    inner_models.resize(num_inner_models);
+    if (!in.read(reinterpret_cast<char *>(inner_models.data()),
+                 inner_models.size() * sizeof(linear_model))) {
+      return false;
+    }
+    leaf_models.resize(hp.num_leaf_models);
+    if (!in.read(reinterpret_cast<char *>(leaf_models.data()),
+                 leaf_models.size() * sizeof(linear_model))) {
+      return false;
+    }
+    training_sample.clear();
+    trained = true;
+    return true;
+  }
+
+  // Carves the leaves that cover the keys in [min_key, max_key] out of the
+  // model, and rescales their CDF to the range of those keys. A model trained
+  // over a whole input thus sorts any of its partitions without retraining.
+  // Fails when the slice has too few leaves to tell the keys apart, or too
+  // many to cache, and on 3-layer models, whose leaves are not in key order.
+  bool slice(converted_t min_key, converted_t max_key,
+             TwoLayerRMI &sliced) const {
+    if (!trained or min_key >= max_key or !inner_models.empty()) return false;
+
+    const long first_leaf = leaf_of(min_key);
+    const long num_leaves = leaf_of(max_key) - first_leaf + 1;
+    if (num_leaves < Params::MIN_SLICE_LEAVES or
+        num_leaves > Params::MAX_SLICE_LEAVES) {
+      return false;
+    }
+
+    auto cdf_of = [&](converted_t key, long leaf_idx) {
+      return std::clamp(leaf_models[leaf_idx].slope * key +
+                            leaf_models[leaf_idx].intercept,
+                        0., 1.);
+    };
+    const double min_cdf = cdf_of(min_key, first_leaf);
+    const double cdf_range =
+        cdf_of(max_key, first_leaf + num_leaves - 1) - min_cdf;
+    if (!(cdf_range > 0)) return false;
+
+    sliced.hp = hp;
+    sliced.hp.num_leaf_models = num_leaves;
+    sliced.enable_dups_detection = enable_dups_detection;
+    sliced.inner_models.clear();
+    sliced.root_model.slope = root_model.slope;
+    sliced.root_model.intercept = root_model.intercept - first_leaf;
+    sliced.leaf_models.resize(num_leaves);
+    for (long i = 0; i < num_leaves; ++i) {
+      auto &leaf = leaf_models[first_leaf + i];
+      sliced.leaf_models[i].slope = leaf.slope / cdf_range;
+      sliced.leaf_models[i].intercept = (leaf.intercept - min_cdf) / cdf_range;
+    }
+    sliced.trained = true;
+    return true;
+  }
+
+  // Trains the model over the `converted_key` fields of a range of entries
+  template <class Entry>
+  bool train(const Entry *begin, const Entry *end) {
     // Determine input size
     const long INPUT_SZ = std::distance(begin, end);
 
@@ -131,13 +277,6 @@ class TwoLayerRMI {
            << TwoLayerRMI::Params::DEFAULT_THRESHOLD << ")." << endl;
     }
 
-    // Initialize the CDF model
-    static const long NUM_LAYERS = 2;
-    vector<vector<vector<training_point<Embedding>>>> training_data(NUM_LAYERS);
-    for (long layer_idx = 0; layer_idx < NUM_LAYERS; ++layer_idx) {
-      training_data[layer_idx].resize(hp.num_leaf_models);
-    }
-
     //----------------------------------------------------------//
     //                           SAMPLE                         //
     //----------------------------------------------------------//
@@ -155,13 +294,14 @@ class TwoLayerRMI {
     for (auto i = begin; i < end; i += offset) {
       // NOTE:  We don't directly assign SAMPLE_SZ to this->training_sample_sz
       //        to avoid issues with divisibility
-      this->training_sample.push_back(*i);
+      this->training_sample.push_back(i->converted_key);
     }
 
-    // Sort the sample using the provided comparison function
-    std::sort(
-        this->training_sample.begin(), this->training_sample.end(),
-        [](auto a, auto b) { return strncmp(a.record, b.record, KEY_SZ) < 0; });
+    // Sort the sampled keys, unless the caller has sorted them already
+    if (!std::is_sorted(this->training_sample.begin(),
+                        this->training_sample.end())) {
+      std::sort(this->training_sample.begin(), this->training_sample.end());
+    }
 
     // Count the number of unique keys
     auto sample_cpy = this->training_sample;
@@ -171,47 +311,104 @@ class TwoLayerRMI {
     //----------------------------------------------------------//
 
     // Populate the training data for the root model
+    vector<training_point<converted_t>> training_data;
+    training_data.reserve(this->training_sample.size());
     for (long i = 0; i < SAMPLE_SZ; ++i) {
-      training_data[0][0].push_back(
-          {this->training_sample[i], 1. * i / SAMPLE_SZ});
+      training_data.push_back({this->training_sample[i], 1. * i / SAMPLE_SZ});
     }
 
-    // Train the root model using linear interpolation
-    auto *current_training_data = &training_data[0][0];
-    linear_model *current_model = &(this->root_model);
+    // Two layers first: the root routes the keys to the leaves
+    inner_models.clear();
+    _fit_root(training_data, hp.num_leaf_models);
+    _fit_leaves(training_data);
+
+    // Then three: the root routes the keys to a piecewise-linear CDF, which
+    // routes them to the leaves. Its pieces follow clusters of keys that the
+    // root alone would crowd into a few leaves. Since it costs another lookup
+    // per key, it is only kept when it fits the sample much better.
+    if (hp.num_inner_models > 0) {
+      const double two_layer_error = _mean_error(training_data);
+      auto two_layer_root = root_model;
+      auto two_layer_leaves = leaf_models;
+
+      _fit_root(training_data, hp.num_inner_models);
+      vector<vector<training_point<converted_t>>> buckets(hp.num_inner_models);
+      for (const auto &d : training_data) {
+        buckets[_clamp_rank(root_model.slope * d.x + root_model.intercept,
+                            hp.num_inner_models)]
+            .push_back(d);
+      }
+      inner_models.resize(hp.num_inner_models);
+      _fit_pieces(buckets, inner_models);
+      _fit_leaves(training_data);
+
+      if (!(_mean_error(training_data) * Params::MIN_INNER_LAYER_GAIN <
+            two_layer_error)) {
+        root_model = two_layer_root;
+        leaf_models.swap(two_layer_leaves);
+        inner_models.clear();
+      }
+    }
 
+    // NOTE:
+    // The last stage (layer) of this model contains weights that predict the
+    // CDF of the keys (i.e. Range is [0-1]) When using this model to predict
+    // the position of the keys in the sorted order, you MUST scale the weights
+    // of the last layer to whatever range you are predicting for. The inner
+    // layers of the model have already been extrapolated to the length of the
+    // stage.git
+    //
+    // This is a design choice to help with the portability of the model.
+    //
+    this->trained = true;
+
+    return true;
+  }
+
+ private:
+  // A NaN rank, from a model fitted over identical keys, falls in the first
+  // model, as in the vector kernel. It is told apart by its bits, since -Ofast
+  // lets the compiler assume that there are no NaNs.
+  static inline long _clamp_rank(double rank, long num_models) {
+    const auto bits = std::bit_cast<uint64_t>(rank);
+    if ((bits & ~(1ul << 63)) > 0x7ff0000000000000ul) return 0;
+    return static_cast<long>(std::max(0., std::min(num_models - 1., rank)));
+  }
+
+  // Fits the root by linear interpolation, extrapolated to the number of
+  // models in the next layer
+  void _fit_root(const vector<training_point<converted_t>> &training_data,
+                 long num_next_models) {
     // Find the min and max values in the training set
-    training_point<Embedding> min = current_training_data->front();
-    training_point<Embedding> max = current_training_data->back();
+    training_point<converted_t> min = training_data.front();
+    training_point<converted_t> max = training_data.back();
 
     // Calculate the slope and intercept terms, assuming min.y = 0 and max.y
-    current_model->slope = 1. / (max.x.converted_key - min.x.converted_key);
-    current_model->intercept = -current_model->slope * min.x.converted_key;
+    root_model.slope = 1. / (max.x - min.x);
+    root_model.intercept = -root_model.slope * min.x;
 
     // Extrapolate for the number of models in the next layer
-    current_model->slope *= this->hp.num_leaf_models - 1;
-    current_model->intercept *= this->hp.num_leaf_models - 1;
-
-    // Populate the training data for the next layer
-    for (const auto &d : *current_training_data) {
-      // Predict the model index in next layer
-      long rank =
-          current_model->slope * d.x.converted_key + current_model->intercept;
-
-      // Normalize the rank between 0 and the number of models in the next layer
-      rank = std::max(static_cast<long>(0),
-                      std::min(this->hp.num_leaf_models - 1, rank));
+    root_model.slope *= num_next_models - 1;
+    root_model.intercept *= num_next_models - 1;
+  }
 
-      // Place the data in the predicted training bucket
-      training_data[1][rank].push_back(d);
-    }
+  // Routes the training data to the leaves and fits them
+  void _fit_leaves(const vector<training_point<converted_t>> &training_data) {
+    vector<vector<training_point<converted_t>>> buckets(hp.num_leaf_models);
+    for (const auto &d : training_data) buckets[leaf_of(d.x)].push_back(d);
+    _fit_layer(buckets, leaf_models);
+  }
 
-    // Train the leaf models
-    for (long model_idx = 0; model_idx < this->hp.num_leaf_models;
-         ++model_idx) {
+  // Fits each model of a layer to the CDF of the training data routed to it,
+  // by interpolating from the last point of the previous model
+  static void _fit_layer(vector<vector<training_point<converted_t>>> &buckets,
+                         vector<linear_model> &models) {
+    const long num_models = models.size();
+    training_point<converted_t> min, max;
+    for (long model_idx = 0; model_idx < num_models; ++model_idx) {
       // Update iterator variables
-      current_training_data = &training_data[1][model_idx];
-      current_model = &(this->leaf_models[model_idx]);
+      auto *current_training_data = &buckets[model_idx];
+      linear_model *current_model = &models[model_idx];
 
       // Interpolate the min points in the training buckets
       if (model_idx == 0) {
@@ -224,8 +421,8 @@ class TwoLayerRMI {
 
           // Insert a fictive training point to avoid propagating more than one
           // empty initial models.
-          training_point<Embedding> tp;
-          tp.x.converted_key = 0;
+          training_point<converted_t> tp;
+          tp.x = 0;
           tp.y = 0;
           current_training_data->push_back(tp);
         } else {
@@ -235,12 +432,10 @@ class TwoLayerRMI {
           max = current_training_data->back();
 
           // Hallucinating as if min.y = 0
-          current_model->slope =
-              (1. * max.y) / (max.x.converted_key - min.x.converted_key);
-          current_model->intercept =
-              min.y - current_model->slope * min.x.converted_key;
+          current_model->slope = (1. * max.y) / (max.x - min.x);
+          current_model->intercept = min.y - current_model->slope * min.x;
         }
-      } else if (model_idx == this->hp.num_leaf_models - 1) {
+      } else if (model_idx == num_models - 1) {
         if (current_training_data->empty()) {
           // Case 3: The final model in this layer is empty
 
@@ -249,14 +444,12 @@ class TwoLayerRMI {
         } else {
           // Case 4: The last model in this layer is not empty
 
-          min = training_data[1][model_idx - 1].back();
+          min = buckets[model_idx - 1].back();
           max = current_training_data->back();
 
           // Hallucinating as if max.y = 1
-          current_model->slope =
-              (1. - min.y) / (max.x.converted_key - min.x.converted_key);
-          current_model->intercept =
-              min.y - current_model->slope * min.x.converted_key;
+          current_model->slope = (1. - min.y) / (max.x - min.x);
+          current_model->intercept = min.y - current_model->slope * min.x;
         }
       } else {
         // The current model is not the first model in the current layer
@@ -264,7 +457,7 @@ class TwoLayerRMI {
         if (current_training_data->empty()) {
           // Case 5: The intermediate model in this layer is empty
           current_model->slope = 0;
-          current_model->intercept = training_data[1][model_idx - 1]
+          current_model->intercept = buckets[model_idx - 1]
                                          .back()
                                          .y;  // If the previous model
                                               // was empty too, it will
@@ -275,38 +468,153 @@ class TwoLayerRMI {
           // empty initial models.
           // NOTE: This will _NOT_ throw to DIV/0 due to identical x's and y's
           // because it is working backwards.
-          training_point<Embedding> tp;
-          tp.x = training_data[1][model_idx - 1].back().x;
-          tp.y = training_data[1][model_idx - 1].back().y;
+          training_point<converted_t> tp;
+          tp.x = buckets[model_idx - 1].back().x;
+          tp.y = buckets[model_idx - 1].back().y;
           current_training_data->push_back(tp);
         } else {
           // Case 6: The intermediate leaf model is not empty
 
-          min = training_data[1][model_idx - 1].back();
+          min = buckets[model_idx - 1].back();
           max = current_training_data->back();
 
-          current_model->slope =
-              (max.y - min.y) / (max.x.converted_key - min.x.converted_key);
-          current_model->intercept =
-              min.y - current_model->slope * min.x.converted_key;
+          current_model->slope = (max.y - min.y) / (max.x - min.x);
+          current_model->intercept = min.y - current_model->slope * min.x;
         }
       }
     }
+  }
 
-    // NOTE:
-    // The last stage (layer) of this model contains weights that predict the
-    // CDF of the keys (i.e. Range is [0-1]) When using this model to predict
-    // the position of the keys in the sorted order, you MUST scale the weights
-    // of the last layer to whatever range you are predicting for. The inner
-    // layers of the model have already been extrapolated to the length of the
-    // stage.git
-    //
-    // This is a design choice to help with the portability of the model.
-    //
-    this->trained = true;
+  // Fits each model of a layer to the span of the training data routed to it
+  // alone, so that a narrow cluster of keys is spread over all the models of
+  // the next layer that its share of the CDF calls for. Empty models send the
+  // keys to the end of the previous span.
+  static void _fit_pieces(
+      const vector<vector<training_point<converted_t>>> &buckets,
+      vector<linear_model> &models) {
+    double last_y = 0;
+    for (size_t model_idx = 0; model_idx < models.size(); ++model_idx) {
+      auto &bucket = buckets[model_idx];
+      auto &model = models[model_idx];
+      if (bucket.empty() or bucket.front().x == bucket.back().x) {
+        model.slope = 0;
+        model.intercept = bucket.empty() ? last_y : bucket.front().y;
+      } else {
+        model.slope = (bucket.back().y - bucket.front().y) /
+                      (bucket.back().x - bucket.front().x);
+        model.intercept = bucket.front().y - model.slope * bucket.front().x;
+      }
+      if (!bucket.empty()) last_y = bucket.back().y;
+    }
+  }
 
-    return true;
+  // The mean absolute error of the predicted CDF over the training data
+  double _mean_error(
+      const vector<training_point<converted_t>> &training_data) const {
+    double error = 0;
+    for (const auto &d : training_data) {
+      auto &leaf = leaf_models[leaf_of(d.x)];
+      error += std::abs(std::clamp(leaf.slope * d.x + leaf.intercept, 0., 1.) -
+                        d.y);
+    }
+    return error / training_data.size();
   }
 };
+
+inline void _predict_cdfs_scalar(const TwoLayerRMI &rmi,
+                                 const sort_entry *entries, size_t num_entries,
+                                 double *cdfs) {
+  for (size_t i = 0; i < num_entries; ++i) {
+    const auto key = entries[i].converted_key;
+    auto &leaf = rmi.leaf_models[rmi.leaf_of(key)];
+    cdfs[i] = leaf.slope * key + leaf.intercept;
+  }
+}
+
+#if defined(__x86_64__)
+// Processes one lane per key. The models are gathered as pairs of doubles,
+// the slope at twice the model index and the intercept right after it. The
+// last keys of a block are staged through a zero-padded buffer, so that they
+// go through the same instructions as the others.
+__attribute__((target("avx512f,avx512dq"))) inline void _predict_cdfs_avx512(
+    const TwoLayerRMI &rmi, const sort_entry *entries, size_t num_entries,
+    double *cdfs) {
+  const auto inner = reinterpret_cast<const double *>(rmi.inner_models.data());
+  const auto leaves = reinterpret_cast<const double *>(rmi.leaf_models.data());
+  const bool has_inner = !rmi.inner_models.empty();
+  const __m512d root_slope = _mm512_set1_pd(rmi.root_model.slope);
+  const __m512d root_intercept = _mm512_set1_pd(rmi.root_model.intercept);
+  const __m512d max_inner = _mm512_set1_pd(rmi.inner_models.size() - 1.);
+  const __m512d num_leaves = _mm512_set1_pd(rmi.hp.num_leaf_models);
+  const __m512d max_leaf = _mm512_set1_pd(rmi.hp.num_leaf_models - 1.);
+  const __m512d zero = _mm512_setzero_pd();
+  const __m512i key_offsets = _mm512_set_epi64(
+      7 * sizeof(sort_entry), 6 * sizeof(sort_entry), 5 * sizeof(sort_entry),
+      4 * sizeof(sort_entry), 3 * sizeof(sort_entry), 2 * sizeof(sort_entry),
+      sizeof(sort_entry), 0);
+
+  // Twice the index of the model a rank falls in, out of `max_model` + 1. NaN
+  // ranks fall in the first model, as in TwoLayerRMI::leaf_of().
+  auto model_offsets = [&](__m512d rank, __m512d max_model) {
+    const __mmask8 is_nan =
+        _mm512_fpclass_pd_mask(rank, 0x81); /* quiet or signaling NaN */
+    rank = _mm512_mask_mov_pd(rank, is_nan, zero);
+    auto idx = _mm512_cvttpd_epi64(
+        _mm512_max_pd(zero, _mm512_min_pd(max_model, rank)));
+    return _mm512_slli_epi64(idx, 1);
+  };
+  auto predict = [&](__m512i keys) {
+    const __m512d x = _mm512_cvtepu64_pd(keys);
+    __m512d rank = _mm512_fmadd_pd(root_slope, x, root_intercept);
+    if (has_inner) {
+      auto offsets = model_offsets(rank, max_inner);
+      rank = _mm512_mul_pd(
+          num_leaves,
+          _mm512_fmadd_pd(_mm512_i64gather_pd(offsets, inner, 8), x,
+                          _mm512_i64gather_pd(offsets, inner + 1, 8)));
+    }
+    auto offsets = model_offsets(rank, max_leaf);
+    return _mm512_fmadd_pd(_mm512_i64gather_pd(offsets, leaves, 8), x,
+                           _mm512_i64gather_pd(offsets, leaves + 1, 8));
+  };
+
+  size_t i = 0;
+  for (; i + 8 <= num_entries; i += 8) {
+    auto keys = _mm512_i64gather_epi64(key_offsets, entries + i, 1);
+    _mm512_storeu_pd(cdfs + i, predict(keys));
+  }
+  if (i < num_entries) {
+    alignas(64) converted_t keys[8]{0};
+    alignas(64) double tail_cdfs[8];
+    for (size_t j = i; j < num_entries; ++j) {
+      keys[j - i] = entries[j].converted_key;
+    }
+    _mm512_store_pd(tail_cdfs, predict(_mm512_load_si512(keys)));
+    std::copy(tail_cdfs, tail_cdfs + num_entries - i, cdfs + i);
+  }
+}
+#endif
+
+typedef void (*predict_cdfs_fn)(const TwoLayerRMI &, const sort_entry *,
+                                size_t, double *);
+
+// Picks the widest inference kernel supported by the CPU
+inline predict_cdfs_fn _select_predict_cdfs_kernel() {
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f") and
+      __builtin_cpu_supports("avx512dq")) {
+    return _predict_cdfs_avx512;
+  }
+#endif
+  return _predict_cdfs_scalar;
+}
+
+inline void TwoLayerRMI::predict_cdfs(const sort_entry *entries,
+                                      size_t num_entries, double *cdfs) const {
+  static const predict_cdfs_fn kernel = _select_predict_cdfs_kernel();
+  kernel(*this, entries, num_entries, cdfs);
+}
+
 }  // namespace internal
-}  // namespace elsar
\ No newline at end of file
+}  // namespace elsar
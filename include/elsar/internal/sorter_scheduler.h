@@ -0,0 +1,161 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <future>
+#include <mutex>
+#include <vector>
+
+#include "embedding.h"
+#include "globals.h"
+
+using namespace std;
+
+namespace elsar {
+namespace internal {
+
+// The memory needed to load, sort and write a partition of fixed-size records
+template <class Layout>
+inline size_t _partition_mem(size_t partition_sz) {
+  return partition_sz * (Layout::BYTES_PER_REC +
+                         sizeof(sort_entry) * IN_MEM_SORT_MEM_MULTIPLIER);
+}
+
+// Hands the partitions out to the sorters, largest first, against a live
+// memory budget. A partition holds its share of the budget from the moment it
+// is admitted until it has been written out. When the largest remaining
+// partition does not fit, smaller ones that do are admitted in its place, so
+// that they run alongside the big ones. A partition that exceeds the budget on
+// its own is only admitted once nothing else is in flight.
+class SorterScheduler {
+ public:
+  // `partition_mems` holds the memory needed to load, sort and write each
+  // partition. Empty partitions need none and are never handed out.
+  SorterScheduler(const vector<size_t> &partition_mems, size_t mem_budget)
+      : partition_mems(partition_mems),
+        mem_budget(mem_budget),
+        mem_in_use(0),
+        num_in_flight(0) {
+    for (size_t partition_idx = 0; partition_idx < partition_mems.size();
+         ++partition_idx) {
+      if (partition_mems[partition_idx] > 0) {
+        pending.push_back(partition_idx);
+      }
+    }
+    std::sort(pending.begin(), pending.end(), [&](int a, int b) {
+      return partition_mems[a] > partition_mems[b];
+    });
+  }
+
+  // Waits until a partition can be admitted and returns it in
+  // `partition_idx`. Returns false once all the partitions have been handed
+  // out.
+  bool acquire(int &partition_idx) {
+    unique_lock<mutex> lock(mtx);
+    while (!pending.empty()) {
+      if (_try_admit(partition_idx)) return true;
+      mem_freed.wait(lock);
+    }
+    return false;
+  }
+
+  // Admits a partition only if it fits right away
+  bool try_acquire(int &partition_idx) {
+    lock_guard<mutex> lock(mtx);
+    return _try_admit(partition_idx);
+  }
+
+  // The number of partitions admitted and not yet written out
+  int num_admitted() {
+    lock_guard<mutex> lock(mtx);
+    return num_in_flight;
+  }
+
+  // Returns the memory of a partition that has been written out
+  void release(int partition_idx) {
+    {
+      lock_guard<mutex> lock(mtx);
+      mem_in_use -= partition_mems[partition_idx];
+      --num_in_flight;
+    }
+    mem_freed.notify_all();
+  }
+
+ private:
+  const vector<size_t> &partition_mems;
+  const size_t mem_budget;
+  size_t mem_in_use;
+  int num_in_flight;
+  vector<int> pending; /* by decreasing size */
+  mutex mtx;
+  condition_variable mem_freed;
+
+  bool _try_admit(int &partition_idx) {
+    for (auto it = pending.begin(); it != pending.end(); ++it) {
+      auto mem = partition_mems[*it];
+      if (mem_in_use + mem <= mem_budget or num_in_flight == 0) {
+        partition_idx = *it;
+        pending.erase(it);
+        mem_in_use += mem;
+        ++num_in_flight;
+        return true;
+      }
+    }
+    return false;
+  }
+};
+
+// Runs `num_sorters` sorters over the partitions handed out by the scheduler.
+// `load(partition_idx)` brings a partition in memory, `sort(partition)` sorts
+// it and `write(partition, partition_idx)` writes it out and frees it, after
+// which its memory goes back to the scheduler. While a partition is being
+// sorted, the next partition that fits in memory is loaded and the previous
+// one is written out in the background.
+template <class Load, class Sort, class Write>
+void _run_sorters(SorterScheduler &scheduler, int num_sorters, Load load,
+                  Sort sort, Write write) {
+  using partition_t = decltype(load(0));
+  auto write_and_release = [&](partition_t partition, int partition_idx) {
+    write(partition, partition_idx);
+    scheduler.release(partition_idx);
+  };
+
+#pragma omp parallel num_threads(num_sorters)
+  {
+    future<partition_t> next_partition;
+    future<void> prev_partition_written;
+
+    int next_partition_idx;
+    if (scheduler.acquire(next_partition_idx)) {
+      next_partition = async(launch::async, load, next_partition_idx);
+    }
+
+    while (next_partition.valid()) {
+      auto partition = next_partition.get();
+      auto partition_idx = next_partition_idx;
+      if (scheduler.try_acquire(next_partition_idx)) {
+        next_partition = async(launch::async, load, next_partition_idx);
+      }
+
+      sort(partition);
+
+      if (prev_partition_written.valid()) prev_partition_written.get();
+      prev_partition_written = async(launch::async, write_and_release,
+                                     partition, partition_idx);
+
+      // Nothing else fit while this partition was in flight, so wait for
+      // memory to free up once it has been written out
+      if (!next_partition.valid()) {
+        prev_partition_written.get();
+        if (scheduler.acquire(next_partition_idx)) {
+          next_partition = async(launch::async, load, next_partition_idx);
+        }
+      }
+    }
+
+    if (prev_partition_written.valid()) prev_partition_written.get();
+  }
+}
+
+}  // namespace internal
+}  // namespace elsar
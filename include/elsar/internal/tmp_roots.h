@@ -0,0 +1,90 @@
+#pragma once
+
+#include <sys/statvfs.h>
+
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "globals.h"
+#include "utils.h"
+
+using namespace std;
+
+namespace elsar {
+namespace internal {
+
+// The directories for placing temporary files, given as a colon-separated
+// list, such as one directory per drive. The temporary files are spread over
+// them in proportion to their free space, in a smooth weighted round-robin,
+// so that consecutive files land on different directories and the spill and
+// load I/O is striped over all the drives.
+class TmpRoots {
+ public:
+  explicit TmpRoots(const char *tmp_roots) : next_file(0) {
+    string list(tmp_roots);
+    for (size_t start = 0; start <= list.size();) {
+      auto end = std::min(list.find(':', start), list.size());
+      if (end > start) roots.push_back(list.substr(start, end - start));
+      start = end + 1;
+    }
+    if (roots.empty()) roots.push_back(".");
+
+    // Each directory gets at least one slot of the schedule, and the rest in
+    // proportion to its free space. A directory that cannot be used fails
+    // right away rather than at its first temporary file.
+    vector<size_t> free_bytes(roots.size(), 0);
+    size_t total_free_bytes = 0;
+    for (size_t i = 0; i < roots.size(); ++i) {
+      struct statvfs stats;
+      if (statvfs(roots[i].c_str(), &stats) != 0) {
+        cerr << "Unable to use tmp root " << roots[i] << endl;
+        cerr << strerror(errno) << endl;
+        exit(EXIT_FAILURE);
+      }
+      free_bytes[i] = stats.f_bavail * stats.f_frsize;
+      total_free_bytes += free_bytes[i];
+    }
+    vector<size_t> weights(roots.size(), 1);
+    if (total_free_bytes > 0) {
+      for (size_t i = 0; i < roots.size(); ++i) {
+        weights[i] = std::max<size_t>(
+            1, 1. * free_bytes[i] / total_free_bytes * TMP_ROOT_SLOTS + .5);
+      }
+    }
+
+    size_t total_weight = 0;
+    for (auto weight : weights) total_weight += weight;
+    vector<long> credits(roots.size(), 0);
+    for (size_t slot = 0; slot < total_weight; ++slot) {
+      size_t best = 0;
+      for (size_t i = 0; i < roots.size(); ++i) {
+        credits[i] += weights[i];
+        if (credits[i] > credits[best]) best = i;
+      }
+      credits[best] -= total_weight;
+      schedule.push_back(best);
+    }
+  }
+
+  TmpRoots(const TmpRoots &) = delete;
+  TmpRoots &operator=(const TmpRoots &) = delete;
+
+  // Creates an anonymous temporary file in the next directory of the schedule
+  int open_tmp_file(bool direct = false) {
+    auto file_idx = next_file.fetch_add(1);
+    return utils::_open_tmp_file_or_fail(
+        roots[schedule[file_idx % schedule.size()]].c_str(), direct);
+  }
+
+ private:
+  vector<string> roots;
+  vector<size_t> schedule; /* the directory of each slot */
+  atomic<size_t> next_file;
+};
+
+}  // namespace internal
+}  // namespace elsar
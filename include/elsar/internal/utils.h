@@ -1,16 +1,22 @@
 #pragma once
 
 #include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <unistd.h>
 
 #include <cstring>
 #include <experimental/filesystem>
 #include <fstream>
+#include <numeric>
 #include <thread>
 
 #include "embedding.h"
+#include "fragment_writer.h"
 #include "globals.h"
 #include "in_memory_sort.h"
+#include "io.h"
+#include "key_conversion.h"
 
 using namespace std;
 namespace fs = std::experimental::filesystem;
@@ -18,44 +24,95 @@ namespace fs = std::experimental::filesystem;
 namespace elsar {
 namespace utils {
 
-inline static converted_t _convert_key(const char *);
+int _open_input_or_fail(const char *filename, bool direct = false);
 
-constexpr unsigned char MIN_PRINTABLE_CHAR = 32;
-constexpr unsigned char MAX_PRINTABLE_CHAR = 127;
 constexpr unsigned int MAX_NUM_PROC = 99;
-constexpr unsigned char PRINTABLE_RANGE =
-    MAX_PRINTABLE_CHAR - MIN_PRINTABLE_CHAR;
-static const int MAX_EMBEDDING_VALUE =
-    PRINTABLE_RANGE * PRINTABLE_RANGE + PRINTABLE_RANGE;
-
-inline static converted_t _convert_key(const char *key) {
-  const short num_chars_to_convert = 9;
-  converted_t value = 0;
-  for (auto i = 0; i < num_chars_to_convert; ++i) {
-    value += static_cast<converted_t>((key[i]) - MIN_PRINTABLE_CHAR) *
-             static_cast<converted_t>(
-                 pow(PRINTABLE_RANGE, num_chars_to_convert - i - 1));
-  }
-  return value;
-}
-
-size_t _read_records_file_into_embeddings(FILE *fid, size_t num_recs_to_read,
-                                          Embedding *const converted_batch,
-                                          char *const recs_buf) {
-  auto num_recs_read =
-      fread_unlocked(recs_buf, BYTES_PER_REC, num_recs_to_read, fid);
-  if (num_recs_read != num_recs_to_read) {
-    cerr << "ERROR: Could not read file." << endl;
-    cerr << strerror(errno) << endl;
-    exit(EXIT_FAILURE);
+
+// Converts the keys of `num_recs` consecutive records into `out`
+template <class Layout>
+inline void _convert_record_keys(const char *records, size_t num_recs,
+                                 converted_t *out) {
+  internal::_convert_keys<Layout>(
+      records + Layout::KEY_OFFSET, Layout::BYTES_PER_REC, num_recs, out,
+      Layout::BYTES_PER_REC - Layout::KEY_OFFSET);
+}
+
+// Builds the sort entries of `num_recs` records of the partition buffer
+// `records`, starting at the record with index `first_rec_idx`
+template <class Layout>
+void _convert_records_into_sort_entries(const char *const records,
+                                        uint32_t first_rec_idx,
+                                        size_t num_recs,
+                                        sort_entry *const converted_batch) {
+  converted_t converted_keys[CONVERT_BATCH_RECS];
+  for (size_t batch_start = 0; batch_start < num_recs;
+       batch_start += CONVERT_BATCH_RECS) {
+    const size_t batch_sz =
+        std::min(CONVERT_BATCH_RECS, num_recs - batch_start);
+    const uint32_t batch_rec_idx = first_rec_idx + batch_start;
+    _convert_record_keys<Layout>(
+        records + batch_rec_idx * Layout::BYTES_PER_REC, batch_sz,
+        converted_keys);
+    for (size_t i = 0; i < batch_sz; ++i) {
+      converted_batch[batch_start + i].converted_key = converted_keys[i];
+      converted_batch[batch_start + i].record_idx = batch_rec_idx + i;
+      converted_batch[batch_start + i].key_suffix =
+          internal::_key_suffix<Layout>(
+              records + (batch_rec_idx + i) * Layout::BYTES_PER_REC +
+              Layout::KEY_OFFSET);
+    }
   }
+}
+
+// Samples the keys of `sample_sz` records from the input file into
+// `keys_buf` (KEY_SZ bytes per key). Records are read in contiguous blocks of
+// SAMPLE_BLOCK_RECS spread evenly over the file to keep the reads large.
+template <class Layout>
+size_t _sample_keys_from_file(const char *filename, const size_t num_recs,
+                              const size_t sample_sz, char *const keys_buf,
+                              const int num_threads) {
+  const size_t num_blocks =
+      (sample_sz + SAMPLE_BLOCK_RECS - 1) / SAMPLE_BLOCK_RECS;
+  const size_t block_stride = num_recs / num_blocks; /* records */
 
-  for (size_t rec_idx = 0; rec_idx < num_recs_read; ++rec_idx) {
-    converted_batch[rec_idx].converted_key =
-        utils::_convert_key(recs_buf + rec_idx * BYTES_PER_REC);
-    converted_batch[rec_idx].record = &recs_buf[rec_idx * BYTES_PER_REC];
+  int fd = _open_input_or_fail(filename);
+
+  vector<size_t> block_sizes(num_blocks, 0);
+#pragma omp parallel num_threads(num_threads)
+  {
+    char *block_buf = new char[SAMPLE_BLOCK_RECS * Layout::BYTES_PER_REC];
+
+#pragma omp for
+    for (size_t block_idx = 0; block_idx < num_blocks; ++block_idx) {
+      auto num_recs_to_read =
+          std::min({SAMPLE_BLOCK_RECS, block_stride,
+                    sample_sz - block_idx * SAMPLE_BLOCK_RECS});
+      auto num_bytes = num_recs_to_read * Layout::BYTES_PER_REC;
+      internal::_pread_fully(fd, block_buf, num_bytes,
+                             block_idx * block_stride * Layout::BYTES_PER_REC);
+
+      auto keys_out = keys_buf + block_idx * SAMPLE_BLOCK_RECS * Layout::KEY_SZ;
+      for (size_t rec_idx = 0; rec_idx < num_recs_to_read; ++rec_idx) {
+        memcpy(keys_out + rec_idx * Layout::KEY_SZ,
+               block_buf + rec_idx * Layout::BYTES_PER_REC + Layout::KEY_OFFSET,
+               Layout::KEY_SZ);
+      }
+      block_sizes[block_idx] = num_recs_to_read;
+    }
+
+    delete[] block_buf;
   }
-  return num_recs_read;
+  close(fd);
+
+  // Compact the blocks that came up short
+  size_t num_sampled = 0;
+  for (size_t block_idx = 0; block_idx < num_blocks; ++block_idx) {
+    memmove(keys_buf + num_sampled * Layout::KEY_SZ,
+            keys_buf + block_idx * SAMPLE_BLOCK_RECS * Layout::KEY_SZ,
+            block_sizes[block_idx] * Layout::KEY_SZ);
+    num_sampled += block_sizes[block_idx];
+  }
+  return num_sampled;
 }
 
 inline size_t _file_sz(const char *filename) {
@@ -82,72 +139,275 @@ size_t _avail_mem() {
   return 0;
 }
 
-FILE *_open_output_or_fail(const char *filename) {
-  FILE *fid = fopen(filename, "rb+");
-  if (!fid) {
+// Reads the byte range [start, end) of the input into `buf` and returns where
+// the range begins in it. With direct I/O, the range is widened to block
+// boundaries, so `buf` must be aligned and hold 2 * DIRECT_IO_ALIGNMENT bytes
+// of slack. The unaligned tail of the file is read through the buffered
+// descriptor.
+char *_read_input_range(internal::IOQueue &io, int fd, int direct_fd,
+                        char *buf, size_t start, size_t end, size_t file_sz,
+                        bool direct) {
+  if (!direct) {
+    io.read(fd, buf, end - start, start);
+    io.drain();
+    return buf;
+  }
+
+  auto aligned_start = internal::_align_down(start);
+  auto aligned_end = internal::_align_up(end);
+  if (aligned_end > file_sz) {
+    // The last block of the file is partial
+    aligned_end = internal::_align_down(file_sz);
+    io.read(fd, buf + (aligned_end - aligned_start), end - aligned_end,
+            aligned_end);
+  }
+  io.read(direct_fd, buf, aligned_end - aligned_start, aligned_start);
+  io.drain();
+  return buf + (start - aligned_start);
+}
+
+// Maps the whole input file read-only for sequential access
+char *_map_input_or_fail(const char *filename, size_t file_sz) {
+  int fd = _open_input_or_fail(filename);
+  void *map = mmap(nullptr, file_sz, PROT_READ, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) {
+    cerr << "ERROR: Could not map file:" << filename << endl;
+    cerr << strerror(errno) << endl;
+    exit(EXIT_FAILURE);
+  }
+  close(fd);
+
+  // These are only hints, so their failures are harmless
+  madvise(map, file_sz, MADV_SEQUENTIAL);
+  madvise(map, file_sz, MADV_HUGEPAGE);
+  return static_cast<char *>(map);
+}
+
+// Asks the kernel to start paging in the mapped byte range [start, end)
+inline void _prefetch_mapped_range(char *map, size_t start, size_t end) {
+  if (start >= end) return;
+  auto page_sz = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+  auto aligned_start = start / page_sz * page_sz;
+  madvise(map + aligned_start, end - aligned_start, MADV_WILLNEED);
+}
+
+int _open_output_or_fail(const char *filename, bool direct = false) {
+  int fd = direct ? internal::_open_direct(filename, O_WRONLY)
+                  : open(filename, O_WRONLY);
+  if (fd < 0) {
     cerr << "Unable to open output file: " << filename << endl;
     cerr << strerror(errno) << endl;
     exit(EXIT_FAILURE);
   }
-  return fid;
+  return fd;
 }
 
-void _flush_fragments(vector<char *> *frags, FILE **frag_fids,
-                      size_t *frag_sizes, const int num_partitions) {
-  for (int partition_idx = 0; partition_idx < num_partitions; ++partition_idx) {
-    auto fid = frag_fids[partition_idx];
-    for (auto embedding_itr = frags[partition_idx].begin();
-         embedding_itr != frags[partition_idx].end(); ++embedding_itr) {
-      fwrite_unlocked(*embedding_itr, sizeof(char), BYTES_PER_REC, fid);
+// Writes the records located by `locate(entry) -> {record, length}` in the
+// order of the sort entries to the output file, where they take up the byte
+// range [file_offset, end_offset). With direct I/O, the block-aligned middle
+// of the range goes through `direct_fd`, while the partial blocks at either
+// end (which may be shared with the neighbouring partitions) go through the
+// buffered `fd`.
+template <class RandomIt, class Locator>
+void _write_to_output(internal::IOQueue &io, int fd, int direct_fd,
+                      size_t file_offset, size_t end_offset, RandomIt begin,
+                      Locator locate, bool direct) {
+  const size_t batch_bytes = internal::_align_up(WRITE_BATCH_BYTES);
+
+  size_t head_end = file_offset;
+  size_t tail_start = end_offset;
+  if (direct) {
+    head_end = std::min(end_offset, internal::_align_up(file_offset));
+    tail_start = std::max(head_end, internal::_align_down(end_offset));
+  }
+
+  // Copies the next `len` bytes of the sorted records into `dst`
+  auto itr = begin;
+  size_t rec_off = 0;
+  auto coalesce = [&](char *dst, size_t len) {
+    while (len > 0) {
+      auto [record, rec_len] = locate(*itr);
+      auto num_bytes = std::min(len, rec_len - rec_off);
+      memcpy(dst, record + rec_off, num_bytes);
+      dst += num_bytes;
+      len -= num_bytes;
+      rec_off += num_bytes;
+      if (rec_off == rec_len) {
+        rec_off = 0;
+        ++itr;
+      }
+    }
+  };
+
+  char edge_buf[DIRECT_IO_ALIGNMENT];
+  coalesce(edge_buf, head_end - file_offset);
+  internal::_pwrite_fully(fd, edge_buf, head_end - file_offset, file_offset);
+
+  // Keep enough coalescing buffers to fill the queue
+  const size_t num_batch_bufs = io.uses_io_uring() ? IO_QUEUE_DEPTH : 1;
+  char *batch_bufs = internal::_alloc_aligned(num_batch_bufs * batch_bytes);
+
+  size_t batch_idx = 0;
+  for (auto off = head_end; off < tail_start; off += batch_bytes) {
+    if (batch_idx == num_batch_bufs) {
+      io.drain();
+      batch_idx = 0;
     }
-    frag_sizes[partition_idx] += frags[partition_idx].size();
-    frags[partition_idx].clear();
+    auto batch_buf = batch_bufs + batch_idx++ * batch_bytes;
+    auto len = std::min(batch_bytes, tail_start - off);
+
+    coalesce(batch_buf, len);
+    io.write(direct ? direct_fd : fd, batch_buf, len, off);
   }
+  io.drain();
+  free(batch_bufs);
+
+  coalesce(edge_buf, end_offset - tail_start);
+  internal::_pwrite_fully(fd, edge_buf, end_offset - tail_start, tail_start);
+}
+
+// Writes the records of `records` in the order of the sort entries to the
+// output file starting at `file_offset`
+template <class Layout, class RandomIt>
+void _write_recs_to_output(internal::IOQueue &io, int fd, int direct_fd,
+                           size_t file_offset, const char *records,
+                           RandomIt begin, RandomIt end, bool direct) {
+  const size_t end_offset =
+      file_offset + std::distance(begin, end) * Layout::BYTES_PER_REC;
+  _write_to_output(
+      io, fd, direct_fd, file_offset, end_offset, begin,
+      [&](const sort_entry &entry) {
+        return std::pair(records + entry.record_idx * Layout::BYTES_PER_REC,
+                         Layout::BYTES_PER_REC);
+      },
+      direct);
 }
 
-template <class RandomIt>
-void _write_recs_to_output(FILE *out_fid, size_t file_offset, RandomIt begin,
-                           RandomIt end) {
-  fseek(out_fid, file_offset, SEEK_SET);
-  for (auto itr = begin; itr != end; ++itr) {
-    fwrite_unlocked(itr->record, sizeof(char), BYTES_PER_REC, out_fid);
+// Emits the records of `records` in the order of the sort entries through
+// `sink(buf, len)`, in batches of WRITE_BATCH_BYTES
+template <class Layout, class RandomIt, class Sink>
+void _emit_recs(const char *records, RandomIt begin, RandomIt end,
+                Sink &sink) {
+  constexpr size_t batch_recs =
+      std::max<size_t>(1, WRITE_BATCH_BYTES / Layout::BYTES_PER_REC);
+  vector<char> batch_buf(batch_recs * Layout::BYTES_PER_REC);
+  while (begin != end) {
+    size_t num_recs = 0;
+    for (; begin != end and num_recs < batch_recs; ++begin, ++num_recs) {
+      memcpy(batch_buf.data() + num_recs * Layout::BYTES_PER_REC,
+             records + begin->record_idx * Layout::BYTES_PER_REC,
+             Layout::BYTES_PER_REC);
+    }
+    sink(batch_buf.data(), num_recs * Layout::BYTES_PER_REC);
   }
 }
 
-FILE *_open_input_or_fail(const char *filename) {
-  FILE *fid = fopen(filename, "rb");
-  if (!fid) {
+// A partition loaded in memory, along with the entries used to sort it
+struct loaded_partition {
+  size_t size = 0;
+  char *records = nullptr;
+  sort_entry *entries = nullptr;
+};
+
+void _free_partition(loaded_partition &partition) {
+  free(partition.records);
+  delete[] partition.entries;
+  partition.records = nullptr;
+  partition.entries = nullptr;
+}
+
+int _open_input_or_fail(const char *filename, bool direct) {
+  int fd = direct ? internal::_open_direct(filename, O_RDONLY)
+                  : open(filename, O_RDONLY);
+  if (fd < 0) {
     cerr << "ERROR: Could not open file:" << filename << endl;
     cerr << strerror(errno) << endl;
     exit(EXIT_FAILURE);
   }
 
-  return fid;
+  return fd;
 }
 
-FILE *_open_tmp_file_or_fail(const char *tmpfs_root) {
-  int tmp_fd = openat(AT_FDCWD, tmpfs_root, O_EXCL | O_RDWR | O_TMPFILE, 0600);
+int _open_tmp_file_or_fail(const char *tmpfs_root, bool direct = false) {
+  const int flags = O_EXCL | O_RDWR | O_TMPFILE;
+  int tmp_fd = direct ? internal::_open_direct(tmpfs_root, flags, 0600)
+                      : openat(AT_FDCWD, tmpfs_root, flags, 0600);
   if (tmp_fd < 0) {
     cerr << "Unable to create tmpfile" << endl;
     cerr << strerror(errno) << endl;
     exit(EXIT_FAILURE);
   }
 
-  auto fid = fdopen(tmp_fd, "w+b");
-  if (!fid) {
-    cerr << "ERROR: Unable to fdopen tmpfile." << endl;
-    cerr << strerror(errno) << endl;
+  return tmp_fd;
+}
+
+// Gives the space of a consumed range of a temporary file back to the file
+// system. This is only an optimization, so failures are ignored.
+inline void _release_file_range(int fd, size_t offset, size_t length) {
+  fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length);
+}
+
+// Gathers all the fragments of a spilled partition into memory, converts
+// their records into sort entries, and gives the disk space of the consumed
+// extents back
+template <class Layout>
+loaded_partition _load_partition(
+    const internal::spilled_partition &spilled, int partition_idx,
+    const Options &options) {
+  auto &fragments = spilled.fragments;
+  loaded_partition partition;
+  partition.size = spilled.size;
+  partition.entries = new sort_entry[partition.size];
+
+  // The extents of a fragment are placed back to back, which rebuilds it in
+  // the buffer. With direct I/O, every extent but the padded last one of
+  // each fragment spans whole blocks, so the reads stay aligned as long as
+  // each fragment starts on a block boundary. Fragments also start on a
+  // record boundary, so that the sort entries can address the records by
+  // index.
+  const size_t frag_alignment =
+      options.direct_io ? std::lcm(Layout::BYTES_PER_REC, DIRECT_IO_ALIGNMENT)
+                        : Layout::BYTES_PER_REC;
+  vector<size_t> frag_buf_offsets(fragments.size());
+  size_t buf_sz = 0;
+  for (size_t i = 0; i < fragments.size(); ++i) {
+    buf_sz = (buf_sz + frag_alignment - 1) / frag_alignment * frag_alignment;
+    frag_buf_offsets[i] = buf_sz;
+    for (auto &extent : fragments[i].extents) buf_sz += extent.length;
+  }
+  if (buf_sz / Layout::BYTES_PER_REC > UINT32_MAX) {
+    cerr << "ERROR: Partition " << partition_idx
+         << " is too large to be indexed by the sort entries." << endl;
     exit(EXIT_FAILURE);
   }
+  partition.records = internal::_alloc_aligned(buf_sz);
 
-  return fid;
-}
+  // Queue the reads of all the extents at once
+  internal::IOQueue io(options.io_engine);
+  for (size_t i = 0; i < fragments.size(); ++i) {
+    auto buf_offset = frag_buf_offsets[i];
+    for (auto &extent : fragments[i].extents) {
+      io.read(fragments[i].fd, partition.records + buf_offset, extent.length,
+              extent.offset);
+      buf_offset += extent.length;
+    }
+  }
+  io.drain();
+
+  for (auto &frag : fragments) {
+    for (auto &extent : frag.extents) {
+      _release_file_range(frag.fd, extent.offset, extent.length);
+    }
+  }
 
-void _initialize_fragment_fids_for_th(FILE **frag_fids_for_th, int num_frags,
-                                      const char *tmpfs_root) {
-  for (int i = 0; i < num_frags; ++i) {
-    frag_fids_for_th[i] = _open_tmp_file_or_fail(tmpfs_root);
+  size_t write_head = 0;
+  for (size_t i = 0; i < fragments.size(); ++i) {
+    _convert_records_into_sort_entries<Layout>(
+        partition.records, frag_buf_offsets[i] / Layout::BYTES_PER_REC,
+        fragments[i].num_recs, partition.entries + write_head);
+    write_head += fragments[i].num_recs;
   }
+  return partition;
 }
 
 void _create_output_file(const char *filename, const size_t file_sz) {
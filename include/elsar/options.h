@@ -0,0 +1,36 @@
+#pragma once
+
+namespace elsar {
+
+// The backends available for issuing the file I/O of the sort
+enum class IOEngine {
+  POSIX,    // Blocking pread/pwrite calls
+  IO_URING  // Batched submissions through an io_uring (Linux >= 5.6)
+};
+
+// Runtime options of the external sort
+struct Options {
+  // The I/O backend. Falls back to POSIX when io_uring is unavailable.
+  IOEngine io_engine = IOEngine::POSIX;
+
+  // Bypass the page cache (O_DIRECT) for the input, the temporary fragments
+  // and the output
+  bool direct_io = false;
+
+  // Memory-map the input and partition the records straight from the mapping
+  // instead of reading them into per-reader buffers. Takes precedence over
+  // direct_io for the input.
+  bool mmap_input = false;
+
+  // Sort the partitions with slices of a model trained over the sample of the
+  // whole input, rather than training a model for each partition
+  bool global_model = false;
+
+  // Save the trained models to this file, and load models saved by a previous
+  // run from this one instead of sampling and training, unless the keys have
+  // drifted away from them
+  const char *save_model_path = nullptr;
+  const char *load_model_path = nullptr;
+};
+
+}  // namespace elsar
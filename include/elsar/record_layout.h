@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstddef>
+
+namespace elsar {
+
+// How the key bytes are ordered and normalized
+enum class KeyEncoding {
+  PRINTABLE,  // Printable ASCII characters (32-126), e.g. gensort -a
+  BINARY      // Unsigned bytes compared lexicographically, e.g. gensort -b
+};
+
+// The fixed-width layout of the records to sort: records of `RecordSize`
+// bytes, ordered by the `KeySize` bytes at `KeyOffset`. The sort is
+// specialized for the layout at compile time.
+template <size_t RecordSize, size_t KeySize, size_t KeyOffset = 0,
+          KeyEncoding Encoding = KeyEncoding::PRINTABLE>
+struct RecordLayout {
+  static_assert(KeySize > 0 and KeySize <= 10,
+                "The sort entries hold keys of up to 10 bytes");
+  static_assert(KeyOffset + KeySize <= RecordSize,
+                "The key must lie within the record");
+
+  static constexpr size_t BYTES_PER_REC = RecordSize; /* bytes */
+  static constexpr size_t KEY_SZ = KeySize;           /* bytes */
+  static constexpr size_t KEY_OFFSET = KeyOffset;     /* bytes */
+  static constexpr KeyEncoding KEY_ENCODING = Encoding;
+
+  // The leading key bytes are converted into a 64-bit sort key (9 base-95
+  // digits or 8 bytes), and the rest are kept next to it to break ties
+  static constexpr int MAX_CONVERTED_BYTES =
+      Encoding == KeyEncoding::BINARY ? 8 : 9;
+  static constexpr int NUM_CONVERTED_CHARS =
+      KeySize < MAX_CONVERTED_BYTES ? KeySize : MAX_CONVERTED_BYTES;
+  static constexpr int NUM_SUFFIX_BYTES = KeySize - NUM_CONVERTED_CHARS;
+};
+
+// The 100-byte records with a 10-byte key of gensort
+using GensortLayout = RecordLayout<100, 10>;
+using BinaryGensortLayout = RecordLayout<100, 10, 0, KeyEncoding::BINARY>;
+
+// The format of newline-delimited records of any length, sorted by
+// elsar::sort_lines. Keys are compared as unsigned bytes, and a key that is a
+// prefix of another sorts first.
+struct LineFormat {
+  // The fields of a line are separated by this character
+  char delimiter = '\t';
+
+  // The 0-based index of the field used as the key, or -1 to use the whole
+  // line. Lines with fewer fields have an empty key.
+  int key_field = -1;
+};
+
+}  // namespace elsar
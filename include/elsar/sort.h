@@ -2,8 +2,17 @@
 #include <omp.h>
 #include <sys/stat.h>
 
+#include "internal/fragment_writer.h"
 #include "internal/in_memory_sort.h"
+#include "internal/io.h"
+#include "internal/model_io.h"
+#include "internal/partitioner.h"
+#include "internal/repartitioner.h"
 #include "internal/rmi.h"
+#include "internal/sorter_scheduler.h"
+#include "internal/tmp_roots.h"
+#include "options.h"
+#include "record_layout.h"
 
 namespace elsar {
 
@@ -12,55 +21,172 @@ namespace elsar {
  *
  * @param input_file The name of the input file to be sorted
  * @param output_file The name of the sorted output file to be generated
- * @param tmp_root The root directory for placing temporary files
+ * @param tmp_root The root directory for placing temporary files, or a
+ * colon-separated list of them (such as one per drive) to stripe the
+ * temporary files over
  * @param num_proc The maximum of threads to be used by the program. Note that
  * the algorithm might use less threads than this parameter depending on memory
  * capacity.
+ * @param options Runtime options, such as the I/O engine to use
+ * @tparam Layout The layout of the records, such as their size and where their
+ * key lies (gensort records by default)
  */
+template <class Layout = GensortLayout>
 void sort(const char *input_file, const char *output_file, const char *tmp_root,
-          const size_t num_proc) {
+          const size_t num_proc, const Options &options = Options()) {
   // Initialize parameters
   const size_t input_file_sz = fs::file_size(input_file);
   if (input_file_sz == 0) return;
 
-  static const size_t num_recs = input_file_sz / BYTES_PER_REC;
+  // The temporary files are striped over all the given directories, which
+  // are checked before any work starts
+  internal::TmpRoots tmp_roots(tmp_root);
 
-  const size_t available_mem = utils::_avail_mem();
-
-  const int num_partitions = num_recs / AVG_PARTITION_RECS;
+  const size_t num_recs = input_file_sz / Layout::BYTES_PER_REC;
 
-  const double partition_width =
-      std::floor(1. * utils::MAX_EMBEDDING_VALUE / num_partitions);
+  const size_t available_mem = utils::_avail_mem();
 
   const int num_readers = num_proc;
 
   const size_t avg_bytes_per_reader_th =
-      (num_recs / num_readers) * BYTES_PER_REC; /* except for the last thread */
-
-  const auto avg_mem_for_partition_sorting =
-      AVG_PARTITION_RECS *
-      (BYTES_PER_REC + sizeof(Embedding) * IN_MEM_SORT_MEM_MULTIPLIER);
-
-  const int num_sorters =
-      std::min(num_proc, std::min(input_file_sz, available_mem) /
-                             avg_mem_for_partition_sorting);
+      (num_recs / num_readers) *
+      Layout::BYTES_PER_REC; /* except for the last thread */
+
+  // The sorters pick partitions up from a shared queue, as long as they fit in
+  // the memory left for sorting
+  const size_t sorter_mem_budget = available_mem / 1.4;
+
+  // Partitions hold up to AVG_PARTITION_RECS records, and are small enough
+  // for a few of them to be sorted at once within the budget
+  const size_t partition_recs = std::clamp<size_t>(
+      sorter_mem_budget / (SORTER_PARTITIONS_IN_MEM *
+                           internal::_partition_mem<Layout>(1)),
+      1, AVG_PARTITION_RECS);
+
+  // Each reader stages the records of every partition in a buffer carved out
+  // of a fraction of the memory, which bounds the fan-out of the read phase.
+  // When the input needs more partitions than that, the read phase produces
+  // coarser ones, which an additional pass splits on disk before sorting.
+  const size_t num_spare_staging_bufs =
+      options.io_engine == IOEngine::IO_URING ? IO_QUEUE_DEPTH : 0;
+  const size_t staging_mem = STAGING_MEM_FRACTION * available_mem;
+  const size_t max_fanout =
+      staging_mem / (num_readers * MIN_STAGING_BYTES) - num_spare_staging_bufs;
 
   // Validation checks
-  if ((READ_BATCH_RECS * BYTES_PER_REC * num_readers >= available_mem) or
-      (1.4 * avg_mem_for_partition_sorting >= available_mem)) {
-    cerr << "This size is not supported yet! Max supported size: "
-         << num_proc * available_mem << " bytes" << endl;
+  if (staging_mem / (num_readers * MIN_STAGING_BYTES) <=
+      num_spare_staging_bufs) {
+    cerr << "Not enough memory for " << num_readers << " readers: "
+         << available_mem << " bytes available" << endl;
     exit(EXIT_FAILURE);
   }
 
+  const int num_partitions = std::clamp<size_t>(
+      (num_recs + partition_recs - 1) / partition_recs, 1, max_fanout);
+
+  const size_t num_staging_bufs =
+      num_partitions + num_spare_staging_bufs; /* per reader */
+  const size_t staging_bytes = std::clamp(
+      internal::_align_down(staging_mem / (num_readers * num_staging_bufs)),
+      MIN_STAGING_BYTES, MAX_STAGING_BYTES);
+
+  // The readers' batches take up another fraction of the memory
+  const size_t read_batch_recs = std::clamp<size_t>(
+      READ_MEM_FRACTION * available_mem / (num_readers * Layout::BYTES_PER_REC),
+      CONVERT_BATCH_RECS, READ_BATCH_RECS);
+
+  //----------------------------------------------------------//
+  //               TRAIN THE PARTITIONING MODEL               //
+  //----------------------------------------------------------//
+
+  // With a global model, the sorters slice the model of the whole input for
+  // their partitions instead of training one from scratch. It has as many
+  // leaves for each partition as a model trained over it, as far as the
+  // sample allows.
+  //
+  // Models saved by a previous run skip sampling and training altogether, as
+  // long as the key distribution has not drifted away from them.
+  internal::LearnedPartitioner partitioner(num_partitions);
+  internal::TwoLayerRMI input_rmi;
+  bool models_loaded =
+      options.load_model_path and
+      internal::_load_models<Layout>(options.load_model_path, partitioner,
+                                     input_rmi);
+  if (models_loaded) {
+    auto drift = internal::_model_drift<Layout>(partitioner, input_file,
+                                                num_recs, num_proc);
+    if (drift > MAX_MODEL_DRIFT) {
+      cerr << "\33[93;1mWARNING\33[0m: The keys drifted from the loaded "
+              "models (by "
+           << drift << "). Training new ones." << endl;
+      partitioner = internal::LearnedPartitioner(num_partitions);
+      input_rmi = internal::TwoLayerRMI();
+      models_loaded = false;
+    } else if (!options.global_model) {
+      input_rmi = internal::TwoLayerRMI();
+    }
+  }
+  if (!models_loaded and (num_partitions > 1 or options.save_model_path)) {
+    const size_t sample_sz =
+        std::min<size_t>(num_recs, TRAINING_SAMPLE_RECS);
+    char *sample_keys = new char[sample_sz * Layout::KEY_SZ];
+    auto num_sampled = utils::_sample_keys_from_file<Layout>(
+        input_file, num_recs, sample_sz, sample_keys, num_proc);
+
+    vector<converted_t> converted_sample(num_sampled);
+    internal::_convert_keys<Layout>(
+        sample_keys, Layout::KEY_SZ, num_sampled, converted_sample.data(),
+        Layout::KEY_SZ);
+    Embedding *sample = new Embedding[num_sampled];
+    for (size_t i = 0; i < num_sampled; ++i) {
+      sample[i].record = sample_keys + i * Layout::KEY_SZ;
+      sample[i].converted_key = converted_sample[i];
+    }
+    // Both models are trained over the sorted sample, which is only sorted
+    // once
+    if (options.global_model) {
+      std::sort(sample, sample + num_sampled,
+                [](const Embedding &a, const Embedding &b) {
+                  return a.converted_key < b.converted_key;
+                });
+    }
+    partitioner.train(sample, sample + num_sampled);
+
+    if (options.global_model and num_sampled > 0) {
+      internal::TwoLayerRMI::Params p(1., 1, 1);
+      p.num_leaf_models = std::clamp<long>(
+          num_sampled / GLOBAL_MODEL_SAMPLE_PER_LEAF, p.num_leaf_models,
+          num_partitions * p.num_leaf_models);
+      input_rmi = internal::TwoLayerRMI(p);
+      input_rmi.train(sample, sample + num_sampled);
+      input_rmi.training_sample.clear();
+      input_rmi.training_sample.shrink_to_fit();
+    }
+
+    delete[] sample;
+    delete[] sample_keys;
+  }
+  if (options.save_model_path) {
+    internal::_save_models<Layout>(options.save_model_path, partitioner,
+                                   input_rmi);
+  }
+
+  //----------------------------------------------------------//
+  //                PARTITION THE INPUT ON DISK               //
+  //----------------------------------------------------------//
+
   // Initialize variables
-  vector<char *> **fragments = new vector<char *> *[num_readers];
-  FILE ***fragment_fids = new FILE **[num_readers];
+  char *input_map = options.mmap_input
+                        ? utils::_map_input_or_fail(input_file, input_file_sz)
+                        : nullptr;
+
+  // Each reader spills all of its partitions into a single temporary file,
+  // indexed by the extents written for each partition
+  int *spill_fds = new int[num_readers];
+  vector<vector<internal::spill_extent>> spill_extents(num_readers);
   size_t **fragment_sizes = new size_t *[num_readers];
-  for (int i = 0; i < num_readers + 1; ++i) {
-    fragment_fids[i] = new FILE *[num_partitions];
+  for (int i = 0; i < num_readers; ++i) {
     fragment_sizes[i] = new size_t[num_partitions]{0};
-    fragments[i] = new vector<char *>[num_partitions];
   }
 
 #pragma omp parallel for num_threads(num_readers)
@@ -72,140 +198,192 @@ void sort(const char *input_file, const char *output_file, const char *tmp_root,
       last_byte_to_read = input_file_sz; /* The last thread reads until EOF */
     }
 
-    auto partition_frags_for_reader = fragments[reader_th_idx];
-    FILE *input_fid = utils::_open_input_or_fail(input_file);
-    fseek(input_fid, next_byte_to_read, SEEK_SET);
-
-    utils::_initialize_fragment_fids_for_th(fragment_fids[reader_th_idx],
-                                            num_partitions, tmp_root);
+    internal::IOQueue io(options.io_engine);
+
+    spill_fds[reader_th_idx] =
+        tmp_roots.open_tmp_file(options.direct_io);
+    internal::FragmentWriter fragment_writer(
+        spill_fds[reader_th_idx], spill_extents[reader_th_idx],
+        fragment_sizes[reader_th_idx], num_partitions, staging_bytes, io,
+        options.direct_io);
+
+    // Without a mapping, initialize memory for the records read in a batch,
+    // with room for widening the reads to block boundaries
+    const bool direct_input = options.direct_io and !options.mmap_input;
+    int input_fd = -1;
+    int input_direct_fd = -1;
+    char *recs_buf = nullptr;
+    if (!options.mmap_input) {
+      input_fd = utils::_open_input_or_fail(input_file);
+      input_direct_fd = direct_input
+                            ? utils::_open_input_or_fail(input_file, true)
+                            : input_fd;
+      recs_buf = internal::_alloc_aligned(
+          read_batch_recs * Layout::BYTES_PER_REC + 2 * DIRECT_IO_ALIGNMENT);
+    }
 
-    // Initialize memory for the records read in a batch
-    char *recs_buf = new char[READ_BATCH_RECS * BYTES_PER_REC];
+    // The keys of a block of records are converted at once before routing
+    converted_t converted_keys[CONVERT_BATCH_RECS];
 
     while (next_byte_to_read < last_byte_to_read) {
       auto remaining_recs =
-          (last_byte_to_read - next_byte_to_read) / BYTES_PER_REC;
-
-      auto num_recs_to_read = std::min(READ_BATCH_RECS, remaining_recs);
-      auto num_recs_read =
-          fread(recs_buf, BYTES_PER_REC, num_recs_to_read, input_fid);
-      if (num_recs_read != num_recs_to_read) {
-        cerr << "ERROR: Could not read file." << endl;
-        cerr << strerror(errno) << endl;
-        exit(EXIT_FAILURE);
+          (last_byte_to_read - next_byte_to_read) / Layout::BYTES_PER_REC;
+
+      auto num_recs_read = std::min(read_batch_recs, remaining_recs);
+      auto batch_end =
+          next_byte_to_read + num_recs_read * Layout::BYTES_PER_REC;
+
+      char *batch_recs;
+      if (options.mmap_input) {
+        batch_recs = input_map + next_byte_to_read;
+
+        // Page in the next batch while this one is being partitioned
+        utils::_prefetch_mapped_range(
+            input_map, batch_end,
+            std::min(last_byte_to_read,
+                     batch_end + read_batch_recs * Layout::BYTES_PER_REC));
+      } else {
+        batch_recs = utils::_read_input_range(
+            io, input_fd, input_direct_fd, recs_buf, next_byte_to_read,
+            batch_end, input_file_sz, direct_input);
       }
-      for (size_t i = 0; i < num_recs_read; ++i) {
-        auto emb = (static_cast<int>(recs_buf[i * BYTES_PER_REC]) -
-                    utils::MIN_PRINTABLE_CHAR) *
-                       utils::PRINTABLE_RANGE +
-                   (static_cast<int>(recs_buf[i * BYTES_PER_REC + 1]) -
-                    utils::MIN_PRINTABLE_CHAR);
-
-        auto predicted_partition = std::min(
-            static_cast<int>(emb / partition_width), num_partitions - 1);
-
-        partition_frags_for_reader[predicted_partition].push_back(
-            recs_buf + i * BYTES_PER_REC);
+
+      for (size_t block_start = 0; block_start < num_recs_read;
+           block_start += CONVERT_BATCH_RECS) {
+        const size_t block_sz =
+            std::min(CONVERT_BATCH_RECS, num_recs_read - block_start);
+        const char *block_recs =
+            batch_recs + block_start * Layout::BYTES_PER_REC;
+        utils::_convert_record_keys<Layout>(block_recs, block_sz,
+                                            converted_keys);
+
+        for (size_t i = 0; i < block_sz; ++i) {
+          auto predicted_partition = partitioner.predict(converted_keys[i]);
+
+          fragment_writer.append(predicted_partition,
+                                 block_recs + i * Layout::BYTES_PER_REC,
+                                 Layout::BYTES_PER_REC);
+        }
       }
 
-      utils::_flush_fragments(partition_frags_for_reader,
-                              fragment_fids[reader_th_idx],
-                              fragment_sizes[reader_th_idx], num_partitions);
+      next_byte_to_read += num_recs_read * Layout::BYTES_PER_REC;
+    }
+    fragment_writer.finish();
 
-      next_byte_to_read += num_recs_read * BYTES_PER_REC;
+    if (!options.mmap_input) {
+      if (direct_input) close(input_direct_fd);
+      close(input_fd);
+      free(recs_buf);
     }
-    fclose(input_fid);
-    delete[] recs_buf;
-  }
-  for (int i = 0; i < num_readers; ++i) {
-    delete[] fragments[i];
   }
-  delete[] fragments;
+  if (options.mmap_input) munmap(input_map, input_file_sz);
 
-  utils::_create_output_file(output_file, input_file_sz);
+  //----------------------------------------------------------//
+  //                  SORT THE PARTITIONS                     //
+  //----------------------------------------------------------//
 
-  // Open the output file for each of the sorter threads
-  FILE **out_fids_for_sorters = new FILE *[num_sorters];
-  for (int i = 0; i < num_sorters; ++i) {
-    out_fids_for_sorters[i] = utils::_open_output_or_fail(output_file);
-  }
+  utils::_create_output_file(output_file, input_file_sz);
 
-  vector<size_t> total_partition_sizes(num_partitions, 0);
+  // The sorters write to disjoint ranges of a shared output file
+  int out_fd = utils::_open_output_or_fail(output_file);
+  int out_direct_fd = options.direct_io
+                          ? utils::_open_output_or_fail(output_file, true)
+                          : out_fd;
+
+  // Group the spilled extents by partition, into one fragment per reader. The
+  // fragments of a partition stay ordered by reader, and their extents by
+  // file offset.
+  vector<internal::spilled_partition> partitions(num_partitions);
+  size_t write_offset = 0;
   for (int partition_idx = 0; partition_idx < num_partitions; ++partition_idx) {
-    for (int reader_idx = 0; reader_idx < num_readers + 1; ++reader_idx) {
-      total_partition_sizes[partition_idx] +=
-          fragment_sizes[reader_idx][partition_idx];
+    auto &partition = partitions[partition_idx];
+    partition.write_offset = write_offset;
+    for (int reader_idx = 0; reader_idx < num_readers; ++reader_idx) {
+      auto frag_sz = fragment_sizes[reader_idx][partition_idx];
+      if (frag_sz == 0) continue;
+      partition.size += frag_sz;
+      partition.fragments.push_back({spill_fds[reader_idx], frag_sz, {}});
     }
+    write_offset += partition.size * Layout::BYTES_PER_REC;
   }
-
-  vector<size_t> partition_write_offsets(num_partitions);
-  partition_write_offsets[0] = 0;
-  for (int i = 1; i < num_partitions; ++i) {
-    partition_write_offsets[i] = partition_write_offsets[i - 1] +
-                                 total_partition_sizes[i - 1] * BYTES_PER_REC;
+  for (int reader_idx = 0; reader_idx < num_readers; ++reader_idx) {
+    for (auto &extent : spill_extents[reader_idx]) {
+      for (auto &frag : partitions[extent.partition].fragments) {
+        if (frag.fd == spill_fds[reader_idx]) frag.extents.push_back(extent);
+      }
+    }
+    spill_extents[reader_idx].clear();
+    spill_extents[reader_idx].shrink_to_fit();
   }
 
-#pragma omp parallel for num_threads(num_sorters) schedule(static, 1)
+  // Partitions that would not fit in memory (because the read phase had to
+  // produce coarser ones, or because of skewed or duplicate keys) are split
+  // on disk before sorting. Each concurrent split needs a read batch.
+  vector<int> oversized_partitions;
   for (int partition_idx = 0; partition_idx < num_partitions; ++partition_idx) {
-    auto partition_size = total_partition_sizes[partition_idx];
-    if (partition_size > 0) {
-      Embedding *partition_contents = new Embedding[partition_size];
-      size_t write_head = 0;
-      char *rec_buf = new char[partition_size * BYTES_PER_REC];
-      char *sorted_rec_buf = new char[partition_size * BYTES_PER_REC];
-      for (int reader_th_idx = 0; reader_th_idx < num_readers;
-           ++reader_th_idx) {
-        rewind(fragment_fids[reader_th_idx][partition_idx]);
-
-        auto num_recs_read = utils::_read_records_file_into_embeddings(
-            fragment_fids[reader_th_idx][partition_idx],
-            fragment_sizes[reader_th_idx][partition_idx],
-            partition_contents + write_head,
-            rec_buf + write_head * BYTES_PER_REC);
-
-        fclose(fragment_fids[reader_th_idx][partition_idx]);
-        write_head += num_recs_read;
-      }
-
-      elsar::internal::in_memory_sort(partition_contents,
-                                      partition_contents + partition_size,
-                                      partition_size);
-
-      auto th_id = omp_get_thread_num();
-
-      char *sorted_buf_batch = new char[WRITE_BATCH_SZ * BYTES_PER_REC];
-      write_head = 0;
-      fseek(out_fids_for_sorters[th_id], partition_write_offsets[partition_idx],
-            SEEK_SET);
-      while (write_head < partition_size) {
-        auto remaining_recs = partition_size - write_head;
-        auto num_recs_to_write = std::min(WRITE_BATCH_SZ, remaining_recs);
-
-        // Coalesce
-        for (size_t rec_idx = 0; rec_idx < num_recs_to_write; ++rec_idx) {
-          memcpy(sorted_buf_batch + rec_idx * BYTES_PER_REC,
-                 partition_contents[write_head + rec_idx].record,
-                 BYTES_PER_REC);
-        }
-        fwrite_unlocked(sorted_buf_batch, sizeof(char) * BYTES_PER_REC,
-                        num_recs_to_write, out_fids_for_sorters[th_id]);
-        write_head += num_recs_to_write;
-      }
-
-      delete[] sorted_buf_batch;
-      delete[] rec_buf;
-      delete[] partition_contents;
+    if (internal::_partition_mem<Layout>(
+            partitions[partition_idx].size) > sorter_mem_budget) {
+      oversized_partitions.push_back(partition_idx);
     }
   }
+  const int num_splitters = std::clamp<size_t>(
+      std::min<size_t>(oversized_partitions.size(),
+                       READ_MEM_FRACTION * sorter_mem_budget /
+                           REPARTITION_BATCH_BYTES),
+      1, num_proc);
+  internal::Repartitioner<Layout> repartitioner(tmp_roots, sorter_mem_budget,
+                                                partition_recs, out_fd,
+                                                options, num_splitters);
+  partitions = repartitioner.split_oversized(partitions);
 
-  for (int i = 0; i < num_sorters; i++) {
-    fclose(out_fids_for_sorters[i]);
+  const int num_sorters =
+      std::max(1, std::min<int>(num_proc, partitions.size()));
+  vector<size_t> partition_mems(partitions.size());
+  for (size_t i = 0; i < partitions.size(); ++i) {
+    partition_mems[i] = internal::_partition_mem<Layout>(partitions[i].size);
   }
 
+  auto load_partition = [&](int partition_idx) {
+    return utils::_load_partition<Layout>(partitions[partition_idx],
+                                          partition_idx, options);
+  };
+
+  internal::SorterScheduler scheduler(partition_mems, sorter_mem_budget);
+
+  // Writes a sorted partition to its place in the output file and frees it
+  auto write_partition = [&](utils::loaded_partition partition,
+                             int partition_idx) {
+    internal::IOQueue io(options.io_engine);
+    utils::_write_recs_to_output<Layout>(
+        io, out_fd, out_direct_fd, partitions[partition_idx].write_offset,
+        partition.records, partition.entries,
+        partition.entries + partition.size, options.direct_io);
+    utils::_free_partition(partition);
+  };
+
+  // The cores left idle by the sorters, either because memory limits the
+  // number of partitions in flight or because the queue is running dry, help
+  // sorting the admitted partitions
+  auto sort_partition = [&](utils::loaded_partition &partition) {
+    const int num_threads =
+        std::max<int>(1, num_proc / std::max(1, scheduler.num_admitted()));
+    elsar::internal::in_memory_sort(
+        partition.entries, partition.entries + partition.size, partition.size,
+        num_threads, input_rmi.trained ? &input_rmi : nullptr);
+  };
+  omp_set_max_active_levels(2);
+
+  internal::_run_sorters(scheduler, num_sorters, load_partition,
+                         sort_partition, write_partition);
+
+  if (options.direct_io) close(out_direct_fd);
+  close(out_fd);
+
   for (int i = 0; i < num_readers; i++) {
+    close(spill_fds[i]);
     delete[] fragment_sizes[i];
   }
   delete[] fragment_sizes;
-  delete[] fragment_fids;
+  delete[] spill_fds;
 }
 }  // namespace elsar
@@ -0,0 +1,127 @@
+#pragma once
+
+#include <vector>
+
+#include "internal/in_memory_sort.h"
+#include "internal/utils.h"
+#include "record_layout.h"
+
+namespace elsar {
+namespace internal {
+
+// Builds the sort entries of a buffer of records in parallel, and sorts them
+template <class Layout>
+sort_entry *_sort_buffer_entries(const char *records, size_t num_recs,
+                                 size_t num_proc) {
+  if (num_recs > UINT32_MAX) {
+    cerr << "ERROR: " << num_recs
+         << " records are too many to be indexed by the sort entries." << endl;
+    exit(EXIT_FAILURE);
+  }
+
+  auto entries = new sort_entry[num_recs];
+  const size_t chunk_recs = CONVERT_BATCH_RECS * 64;
+#pragma omp parallel for num_threads(num_proc) schedule(static)
+  for (size_t chunk_start = 0; chunk_start < num_recs;
+       chunk_start += chunk_recs) {
+    utils::_convert_records_into_sort_entries<Layout>(
+        records, chunk_start, std::min(chunk_recs, num_recs - chunk_start),
+        entries + chunk_start);
+  }
+
+  in_memory_sort(entries, entries + num_recs, num_recs, num_proc);
+  return entries;
+}
+
+// Moves the records to their sorted positions by following the cycles of the
+// permutation, one record at a time. The record indices of the entries are
+// overwritten to mark the positions already filled.
+template <class Layout>
+void _permute_in_place(char *records, sort_entry *entries, size_t num_recs) {
+  char tmp[Layout::BYTES_PER_REC];
+  for (size_t cycle_start = 0; cycle_start < num_recs; ++cycle_start) {
+    if (entries[cycle_start].record_idx == cycle_start) continue;
+
+    memcpy(tmp, records + cycle_start * Layout::BYTES_PER_REC,
+           Layout::BYTES_PER_REC);
+    size_t pos = cycle_start;
+    while (entries[pos].record_idx != cycle_start) {
+      size_t src = entries[pos].record_idx;
+      memcpy(records + pos * Layout::BYTES_PER_REC,
+             records + src * Layout::BYTES_PER_REC, Layout::BYTES_PER_REC);
+      entries[pos].record_idx = pos;
+      pos = src;
+    }
+    memcpy(records + pos * Layout::BYTES_PER_REC, tmp, Layout::BYTES_PER_REC);
+    entries[pos].record_idx = pos;
+  }
+}
+}  // namespace internal
+
+/**
+ * @brief Sorts a buffer of records in memory, in place, with the learned sort
+ *
+ * @param records The contiguous records to be sorted, owned by the caller
+ * @param num_recs The number of records in the buffer, up to UINT32_MAX
+ * @param num_proc The maximum of threads to be used
+ * @tparam Layout The layout of the records, such as their size and where their
+ * key lies (gensort records by default)
+ *
+ * The sort is not stable. The records are gathered through a copy of the
+ * buffer when there is enough memory for one, and moved one at a time along
+ * the cycles of the permutation otherwise.
+ */
+template <class Layout = GensortLayout>
+void sort_buffer(char *records, size_t num_recs, size_t num_proc) {
+  if (num_recs == 0) return;
+  auto entries =
+      internal::_sort_buffer_entries<Layout>(records, num_recs, num_proc);
+
+  const size_t buf_sz = num_recs * Layout::BYTES_PER_REC;
+  char *sorted = buf_sz < utils::_avail_mem() / 2
+                     ? static_cast<char *>(malloc(buf_sz))
+                     : nullptr;
+  if (sorted) {
+#pragma omp parallel num_threads(num_proc)
+    {
+#pragma omp for schedule(static)
+      for (size_t i = 0; i < num_recs; ++i) {
+        memcpy(sorted + i * Layout::BYTES_PER_REC,
+               records + entries[i].record_idx * Layout::BYTES_PER_REC,
+               Layout::BYTES_PER_REC);
+      }
+#pragma omp for schedule(static)
+      for (size_t i = 0; i < num_recs; ++i) {
+        memcpy(records + i * Layout::BYTES_PER_REC,
+               sorted + i * Layout::BYTES_PER_REC, Layout::BYTES_PER_REC);
+      }
+    }
+    free(sorted);
+  } else {
+    internal::_permute_in_place<Layout>(records, entries, num_recs);
+  }
+  delete[] entries;
+}
+
+/**
+ * @brief Returns the sorted order of a buffer of records, leaving the buffer
+ * untouched: the i-th record in key order is `records[order[i]]`
+ *
+ * @param records The contiguous records to be ordered, owned by the caller
+ * @param num_recs The number of records in the buffer, up to UINT32_MAX
+ * @param num_proc The maximum of threads to be used
+ * @tparam Layout The layout of the records (gensort records by default)
+ */
+template <class Layout = GensortLayout>
+vector<uint32_t> sorted_order(const char *records, size_t num_recs,
+                              size_t num_proc) {
+  vector<uint32_t> order(num_recs);
+  if (num_recs == 0) return order;
+  auto entries =
+      internal::_sort_buffer_entries<Layout>(records, num_recs, num_proc);
+#pragma omp parallel for num_threads(num_proc) schedule(static)
+  for (size_t i = 0; i < num_recs; ++i) order[i] = entries[i].record_idx;
+  delete[] entries;
+  return order;
+}
+}  // namespace elsar
@@ -0,0 +1,429 @@
+#pragma once
+#include <omp.h>
+#include <sys/stat.h>
+
+#include "internal/fragment_writer.h"
+#include "internal/in_memory_sort.h"
+#include "internal/io.h"
+#include "internal/line_repartitioner.h"
+#include "internal/lines.h"
+#include "internal/partitioner.h"
+#include "internal/sorter_scheduler.h"
+#include "internal/tmp_roots.h"
+#include "internal/utils.h"
+#include "options.h"
+#include "record_layout.h"
+
+namespace elsar {
+
+/**
+ * @brief The external sorting function (ELSAR) for newline-delimited records
+ * of any length, such as text, TSV or log files. Every line of the output ends
+ * with a newline, including the last one.
+ *
+ * @param input_file The name of the input file to be sorted
+ * @param output_file The name of the sorted output file to be generated
+ * @param tmp_root The root directory for placing temporary files, or a
+ * colon-separated list of them (such as one per drive) to stripe the
+ * temporary files over
+ * @param num_proc The maximum of threads to be used by the program
+ * @param format Which part of the lines to sort them by
+ * @param options Runtime options, such as the I/O engine to use
+ */
+void sort_lines(const char *input_file, const char *output_file,
+                const char *tmp_root, const size_t num_proc,
+                const LineFormat &format = LineFormat(),
+                const Options &options = Options()) {
+  // Initialize parameters
+  const size_t input_file_sz = fs::file_size(input_file);
+  if (input_file_sz == 0) return;
+
+  // The temporary files are striped over all the given directories, which
+  // are checked before any work starts
+  internal::TmpRoots tmp_roots(tmp_root);
+
+  const size_t available_mem = utils::_avail_mem();
+
+  const int num_readers = num_proc;
+
+  const size_t sorter_mem_budget = available_mem / 1.4;
+
+  // The last line gets the newline it may lack in the output
+  int input_fd = utils::_open_input_or_fail(input_file);
+  char last_char;
+  internal::_pread_fully(input_fd, &last_char, 1, input_file_sz - 1);
+  const size_t output_file_sz = input_file_sz + (last_char != '\n');
+
+  //----------------------------------------------------------//
+  //                    SAMPLE THE INPUT                      //
+  //----------------------------------------------------------//
+
+  vector<converted_t> sample_keys;
+  const double avg_line_bytes = internal::_sample_line_keys(
+      input_fd, input_file_sz, format, num_proc, sample_keys);
+
+  // Partitions hold up to MAX_LINE_PARTITION_BYTES bytes, and are small
+  // enough for a few of them to be sorted at once within the budget
+  const size_t target_partition_bytes = std::clamp<size_t>(
+      sorter_mem_budget /
+          (SORTER_PARTITIONS_IN_MEM *
+           internal::_line_partition_mem(avg_line_bytes, 1)) *
+          avg_line_bytes,
+      1, MAX_LINE_PARTITION_BYTES);
+
+  // Each reader stages the lines of every partition in a buffer carved out of
+  // a fraction of the memory, which bounds the number of partitions
+  const size_t num_spare_staging_bufs =
+      options.io_engine == IOEngine::IO_URING ? IO_QUEUE_DEPTH : 0;
+  const size_t staging_mem = STAGING_MEM_FRACTION * available_mem;
+
+  // Validation checks
+  if (staging_mem / (num_readers * MIN_STAGING_BYTES) <=
+      num_spare_staging_bufs) {
+    cerr << "Not enough memory for " << num_readers << " readers: "
+         << available_mem << " bytes available" << endl;
+    exit(EXIT_FAILURE);
+  }
+
+  const size_t max_fanout =
+      staging_mem / (num_readers * MIN_STAGING_BYTES) - num_spare_staging_bufs;
+  const int num_partitions = std::clamp<size_t>(
+      (input_file_sz + target_partition_bytes - 1) / target_partition_bytes, 1,
+      max_fanout);
+
+  const size_t num_staging_bufs =
+      num_partitions + num_spare_staging_bufs; /* per reader */
+  const size_t staging_bytes = std::clamp(
+      internal::_align_down(staging_mem / (num_readers * num_staging_bufs)),
+      MIN_STAGING_BYTES, MAX_STAGING_BYTES);
+
+  // The readers' batches take up another fraction of the memory. A batch
+  // grows when a single line does not fit in it.
+  const size_t read_batch_bytes = std::clamp<size_t>(
+      READ_MEM_FRACTION * available_mem / num_readers, MIN_STAGING_BYTES,
+      LINE_READ_BATCH_BYTES);
+
+  // The readers start on line boundaries
+  vector<size_t> reader_starts(num_readers + 1);
+  for (int reader_idx = 0; reader_idx <= num_readers; ++reader_idx) {
+    reader_starts[reader_idx] = internal::_next_line_start(
+        input_fd, input_file_sz / num_readers * reader_idx, input_file_sz);
+  }
+  reader_starts[num_readers] = input_file_sz;
+  close(input_fd);
+
+  //----------------------------------------------------------//
+  //               TRAIN THE PARTITIONING MODEL               //
+  //----------------------------------------------------------//
+
+  internal::LearnedPartitioner partitioner(num_partitions);
+  if (num_partitions > 1) {
+    vector<Embedding> sample(sample_keys.size());
+    for (size_t i = 0; i < sample_keys.size(); ++i) {
+      sample[i].converted_key = sample_keys[i];
+    }
+    partitioner.train(sample.data(), sample.data() + sample.size());
+  }
+  sample_keys.clear();
+  sample_keys.shrink_to_fit();
+
+  //----------------------------------------------------------//
+  //                PARTITION THE INPUT ON DISK               //
+  //----------------------------------------------------------//
+
+  char *input_map = options.mmap_input
+                        ? utils::_map_input_or_fail(input_file, input_file_sz)
+                        : nullptr;
+
+  // Each reader spills all of its partitions into a single temporary file,
+  // indexed by the extents written for each partition. It counts both the
+  // lines and the bytes of its fragments.
+  int *spill_fds = new int[num_readers];
+  vector<vector<internal::spill_extent>> spill_extents(num_readers);
+  vector<vector<size_t>> fragment_sizes(num_readers,
+                                        vector<size_t>(num_partitions, 0));
+  vector<vector<size_t>> fragment_bytes(num_readers,
+                                        vector<size_t>(num_partitions, 0));
+
+#pragma omp parallel for num_threads(num_readers)
+  for (int reader_th_idx = 0; reader_th_idx < num_readers; ++reader_th_idx) {
+    auto next_byte_to_read = reader_starts[reader_th_idx];
+    auto last_byte_to_read = reader_starts[reader_th_idx + 1];
+
+    internal::IOQueue io(options.io_engine);
+
+    spill_fds[reader_th_idx] =
+        tmp_roots.open_tmp_file(options.direct_io);
+    internal::FragmentWriter fragment_writer(
+        spill_fds[reader_th_idx], spill_extents[reader_th_idx],
+        fragment_sizes[reader_th_idx].data(), num_partitions, staging_bytes,
+        io, options.direct_io);
+    auto &partition_bytes_written = fragment_bytes[reader_th_idx];
+
+    const bool direct_input = options.direct_io and !options.mmap_input;
+    int input_fd = -1;
+    int input_direct_fd = -1;
+    if (!options.mmap_input) {
+      input_fd = utils::_open_input_or_fail(input_file);
+      input_direct_fd = direct_input
+                            ? utils::_open_input_or_fail(input_file, true)
+                            : input_fd;
+    }
+
+    // A batch only hands its complete lines over, and the next one starts
+    // with the line cut by its end
+    size_t batch_bytes = read_batch_bytes;
+    char *recs_buf = nullptr;
+    while (next_byte_to_read < last_byte_to_read) {
+      auto batch_end = std::min(last_byte_to_read,
+                                next_byte_to_read + batch_bytes);
+
+      char *batch;
+      if (options.mmap_input) {
+        batch = input_map + next_byte_to_read;
+        utils::_prefetch_mapped_range(
+            input_map, batch_end,
+            std::min(last_byte_to_read, batch_end + batch_bytes));
+      } else {
+        if (!recs_buf) {
+          recs_buf =
+              internal::_alloc_aligned(batch_bytes + 2 * DIRECT_IO_ALIGNMENT);
+        }
+        batch = utils::_read_input_range(
+            io, input_fd, input_direct_fd, recs_buf, next_byte_to_read,
+            batch_end, input_file_sz, direct_input);
+      }
+
+      const size_t batch_len = batch_end - next_byte_to_read;
+      size_t pos = 0;
+      while (pos < batch_len) {
+        auto line = batch + pos;
+        auto newline =
+            static_cast<char *>(memchr(line, '\n', batch_len - pos));
+        if (!newline and batch_end < last_byte_to_read) break;
+        size_t line_len = newline ? newline - line : batch_len - pos;
+
+        size_t key_start, key_length;
+        internal::_find_line_key(line, line_len, format, key_start,
+                                 key_length);
+        auto partition_idx = partitioner.predict(
+            internal::_convert_key_prefix(line + key_start, key_length));
+
+        if (newline) {
+          fragment_writer.append(partition_idx, line, line_len + 1);
+        } else {
+          // The last line of the input lacks its newline
+          string last_line(line, line_len);
+          last_line += '\n';
+          fragment_writer.append(partition_idx, last_line.data(),
+                                 last_line.size());
+        }
+        partition_bytes_written[partition_idx] += line_len + 1;
+        pos += line_len + 1;
+      }
+
+      if (pos == 0) {
+        // The batch is too small for the line it starts with
+        batch_bytes *= 2;
+        free(recs_buf);
+        recs_buf = nullptr;
+      }
+      next_byte_to_read += std::min(pos, batch_len);
+    }
+    fragment_writer.finish();
+
+    if (!options.mmap_input) {
+      if (direct_input) close(input_direct_fd);
+      close(input_fd);
+      free(recs_buf);
+    }
+  }
+  if (options.mmap_input) munmap(input_map, input_file_sz);
+
+  //----------------------------------------------------------//
+  //                  SORT THE PARTITIONS                     //
+  //----------------------------------------------------------//
+
+  utils::_create_output_file(output_file, output_file_sz);
+
+  // The sorters write to disjoint ranges of a shared output file
+  int out_fd = utils::_open_output_or_fail(output_file);
+  int out_direct_fd = options.direct_io
+                          ? utils::_open_output_or_fail(output_file, true)
+                          : out_fd;
+
+  // Group the spilled extents by partition, into one fragment per reader
+  vector<internal::spilled_partition> partitions(num_partitions);
+  vector<size_t> partition_bytes(num_partitions, 0);
+  size_t write_offset = 0;
+  for (int partition_idx = 0; partition_idx < num_partitions; ++partition_idx) {
+    auto &partition = partitions[partition_idx];
+    partition.write_offset = write_offset;
+    for (int reader_idx = 0; reader_idx < num_readers; ++reader_idx) {
+      auto frag_sz = fragment_sizes[reader_idx][partition_idx];
+      if (frag_sz == 0) continue;
+      partition.size += frag_sz;
+      partition_bytes[partition_idx] +=
+          fragment_bytes[reader_idx][partition_idx];
+      partition.fragments.push_back({spill_fds[reader_idx], frag_sz, {}});
+    }
+    write_offset += partition_bytes[partition_idx];
+  }
+  for (int reader_idx = 0; reader_idx < num_readers; ++reader_idx) {
+    for (auto &extent : spill_extents[reader_idx]) {
+      for (auto &frag : partitions[extent.partition].fragments) {
+        if (frag.fd == spill_fds[reader_idx]) frag.extents.push_back(extent);
+      }
+    }
+    spill_extents[reader_idx].clear();
+    spill_extents[reader_idx].shrink_to_fit();
+  }
+
+  // Partitions that would not fit in memory (because of skewed keys, or keys
+  // that share more than the first chunk the partitioner looks at) are split
+  // on disk before sorting. Each concurrent split needs a read batch.
+  size_t num_oversized = 0;
+  for (int partition_idx = 0; partition_idx < num_partitions; ++partition_idx) {
+    num_oversized += internal::_line_partition_mem(
+                         partition_bytes[partition_idx],
+                         partitions[partition_idx].size) > sorter_mem_budget;
+  }
+  const int num_splitters = std::clamp<size_t>(
+      std::min<size_t>(num_oversized, READ_MEM_FRACTION * sorter_mem_budget /
+                                          REPARTITION_BATCH_BYTES),
+      1, num_proc);
+  internal::LineRepartitioner repartitioner(tmp_roots, sorter_mem_budget,
+                                            target_partition_bytes, out_fd,
+                                            format, options, num_splitters);
+  repartitioner.split_oversized(partitions, partition_bytes);
+
+  vector<size_t> partition_mems(partitions.size());
+  for (size_t i = 0; i < partitions.size(); ++i) {
+    partition_mems[i] =
+        internal::_line_partition_mem(partition_bytes[i], partitions[i].size);
+  }
+  const int num_sorters =
+      std::max(1, std::min<int>(num_proc, partitions.size()));
+
+  // A partition of lines loaded in memory
+  struct loaded_lines {
+    size_t size = 0;
+    char *records = nullptr;
+    internal::line_ref *lines = nullptr;
+    sort_entry *entries = nullptr;
+  };
+
+  // Gathers all the fragments of a partition from the spill files, and
+  // indexes its lines
+  auto load_partition = [&](int partition_idx) {
+    auto &fragments = partitions[partition_idx].fragments;
+    loaded_lines partition;
+    partition.size = partitions[partition_idx].size;
+    if (partition.size > UINT32_MAX) {
+      cerr << "ERROR: Partition " << partition_idx
+           << " is too large to be indexed by the sort entries." << endl;
+      exit(EXIT_FAILURE);
+    }
+    partition.lines = new internal::line_ref[partition.size];
+    partition.entries = new sort_entry[partition.size];
+
+    // The extents of a fragment are placed back to back, which rebuilds it in
+    // the buffer. With direct I/O, each fragment starts on a block boundary.
+    const size_t frag_alignment = options.direct_io ? DIRECT_IO_ALIGNMENT : 1;
+    vector<size_t> frag_buf_offsets(fragments.size());
+    size_t buf_sz = 0;
+    for (size_t i = 0; i < fragments.size(); ++i) {
+      buf_sz = (buf_sz + frag_alignment - 1) / frag_alignment * frag_alignment;
+      frag_buf_offsets[i] = buf_sz;
+      for (auto &extent : fragments[i].extents) buf_sz += extent.length;
+    }
+    partition.records = internal::_alloc_aligned(buf_sz);
+
+    internal::IOQueue io(options.io_engine);
+    for (size_t i = 0; i < fragments.size(); ++i) {
+      auto buf_offset = frag_buf_offsets[i];
+      for (auto &extent : fragments[i].extents) {
+        io.read(fragments[i].fd, partition.records + buf_offset, extent.length,
+                extent.offset);
+        buf_offset += extent.length;
+      }
+    }
+    io.drain();
+
+    for (auto &frag : fragments) {
+      for (auto &extent : frag.extents) {
+        utils::_release_file_range(frag.fd, extent.offset, extent.length);
+      }
+    }
+
+    // Every spilled line ends with a newline
+    const char *buf_end = partition.records + buf_sz;
+    uint32_t line_idx = 0;
+    for (size_t i = 0; i < fragments.size(); ++i) {
+      const char *line = partition.records + frag_buf_offsets[i];
+      for (size_t j = 0; j < fragments[i].num_recs; ++j, ++line_idx) {
+        auto newline =
+            static_cast<const char *>(memchr(line, '\n', buf_end - line));
+        size_t line_len = newline - line;
+        size_t key_start, key_length;
+        internal::_find_line_key(line, line_len, format, key_start,
+                                 key_length);
+
+        partition.lines[line_idx] = {
+            static_cast<size_t>(line - partition.records),
+            static_cast<uint32_t>(line_len + 1),
+            static_cast<uint32_t>(key_start),
+            static_cast<uint32_t>(key_length)};
+        internal::_convert_key_chunk(line + key_start, key_length, 0,
+                                     partition.entries[line_idx]);
+        partition.entries[line_idx].record_idx = line_idx;
+        line = newline + 1;
+      }
+    }
+    return partition;
+  };
+
+  internal::SorterScheduler scheduler(partition_mems, sorter_mem_budget);
+
+  // Writes a sorted partition to its place in the output file and frees it
+  auto write_partition = [&](loaded_lines partition, int partition_idx) {
+    internal::IOQueue io(options.io_engine);
+    auto file_offset = partitions[partition_idx].write_offset;
+    utils::_write_to_output(
+        io, out_fd, out_direct_fd, file_offset,
+        file_offset + partition_bytes[partition_idx], partition.entries,
+        [&](const sort_entry &entry) {
+          auto &line = partition.lines[entry.record_idx];
+          return std::pair(partition.records + line.offset,
+                           static_cast<size_t>(line.length));
+        },
+        options.direct_io);
+    free(partition.records);
+    delete[] partition.lines;
+    delete[] partition.entries;
+  };
+
+  // The lines are sorted by the first chunk of their keys, with the help of
+  // the idle cores, and then by the next chunks wherever these tie
+  auto sort_partition = [&](loaded_lines &partition) {
+    const int num_threads =
+        std::max<int>(1, num_proc / std::max(1, scheduler.num_admitted()));
+    auto entries_end = partition.entries + partition.size;
+    internal::in_memory_sort(partition.entries, entries_end, partition.size,
+                             num_threads);
+    internal::_sort_line_ties(partition.entries, entries_end,
+                              partition.records, partition.lines,
+                              internal::LINE_KEY_CHUNK_BYTES);
+  };
+  omp_set_max_active_levels(2);
+
+  internal::_run_sorters(scheduler, num_sorters, load_partition,
+                         sort_partition, write_partition);
+
+  if (options.direct_io) close(out_direct_fd);
+  close(out_fd);
+
+  for (int i = 0; i < num_readers; i++) close(spill_fds[i]);
+  delete[] spill_fds;
+}
+}  // namespace elsar
@@ -0,0 +1,347 @@
+#pragma once
+#include <omp.h>
+
+#include <future>
+#include <memory>
+
+#include "internal/fragment_writer.h"
+#include "internal/in_memory_sort.h"
+#include "internal/io.h"
+#include "internal/partitioner.h"
+#include "internal/repartitioner.h"
+#include "internal/rmi.h"
+#include "internal/sorter_scheduler.h"
+#include "internal/tmp_roots.h"
+#include "options.h"
+#include "record_layout.h"
+
+namespace elsar {
+
+/**
+ * @brief The external sorting function (ELSAR) for sequential streams, such
+ * as pipes, whose size is not known in advance and which cannot be read twice
+ *
+ * The partitioning model is trained on the first chunk of the stream, which is
+ * sorted in memory right away when the stream ends within it. Otherwise, the
+ * records are spilled into partitions as they arrive, the partitions skewed by
+ * the first chunk being unrepresentative are split on disk, and the partitions
+ * are then sorted and emitted one after the other, in key order.
+ *
+ * @param source Reads the input, as `size_t source(char *buf, size_t len)`,
+ * which returns the number of bytes read, and 0 at the end of the stream
+ * @param sink Writes the output, as `void sink(const char *buf, size_t len)`
+ * @param tmp_root The root directory for placing temporary files, or a
+ * colon-separated list of them (such as one per drive) to stripe the
+ * temporary files over
+ * @param num_proc The maximum of threads to be used by the program
+ * @param options Runtime options, such as the I/O engine to use
+ * @tparam Layout The layout of the records, such as their size and where their
+ * key lies (gensort records by default)
+ *
+ * The source and the sink are called from one thread at a time, though not
+ * always from the same one. A trailing partial record is dropped.
+ */
+template <class Layout = GensortLayout, class Source, class Sink>
+void sort_stream(Source &&source, Sink &&sink, const char *tmp_root,
+                 const size_t num_proc, const Options &options = Options()) {
+  // The temporary files are striped over all the given directories, which
+  // are checked before any work starts
+  internal::TmpRoots tmp_roots(tmp_root);
+
+  // Initialize parameters
+  const size_t available_mem = utils::_avail_mem();
+
+  const int num_writers = num_proc;
+
+  // The partitions are emitted in key order, so that only one of them is
+  // sorted at a time, by all the cores, while the next one is loaded and the
+  // previous one is emitted
+  const size_t sorter_mem_budget = available_mem / 1.4;
+  const size_t partition_recs = std::clamp<size_t>(
+      sorter_mem_budget / (STREAM_PARTITIONS_IN_MEM *
+                           internal::_partition_mem<Layout>(1)),
+      1, AVG_PARTITION_RECS);
+
+  // Fills `buf` with up to `max_recs` whole records from the source, and
+  // returns how many it got, which is fewer only at the end of the stream
+  auto read_recs = [&](char *buf, size_t max_recs) {
+    const size_t len = max_recs * Layout::BYTES_PER_REC;
+    size_t num_read = 0;
+    while (num_read < len) {
+      auto ret = source(buf + num_read, len - num_read);
+      if (ret == 0) break;
+      num_read += ret;
+    }
+    if (num_read % Layout::BYTES_PER_REC != 0) {
+      cerr << "\33[93;1mWARNING\33[0m: Dropping the trailing "
+           << num_read % Layout::BYTES_PER_REC
+           << " bytes of the input, which do not make up a whole record"
+           << endl;
+    }
+    return num_read / Layout::BYTES_PER_REC;
+  };
+
+  omp_set_max_active_levels(2);
+
+  //----------------------------------------------------------//
+  //                  READ THE FIRST CHUNK                    //
+  //----------------------------------------------------------//
+
+  char *first_chunk =
+      internal::_alloc_aligned(partition_recs * Layout::BYTES_PER_REC);
+  const size_t first_chunk_recs = read_recs(first_chunk, partition_recs);
+
+  // A stream that ends within the first chunk is sorted in memory
+  if (first_chunk_recs < partition_recs) {
+    auto entries = new sort_entry[first_chunk_recs];
+    utils::_convert_records_into_sort_entries<Layout>(
+        first_chunk, 0, first_chunk_recs, entries);
+    internal::in_memory_sort(entries, entries + first_chunk_recs,
+                             first_chunk_recs, num_proc);
+    utils::_emit_recs<Layout>(first_chunk, entries, entries + first_chunk_recs,
+                              sink);
+    delete[] entries;
+    free(first_chunk);
+    return;
+  }
+
+  // Each writer stages the records of every partition in a buffer carved out
+  // of a fraction of the memory, which bounds the fan-out
+  const size_t num_spare_staging_bufs =
+      options.io_engine == IOEngine::IO_URING ? IO_QUEUE_DEPTH : 0;
+  const size_t staging_mem = STAGING_MEM_FRACTION * available_mem;
+  const size_t max_fanout =
+      staging_mem / (num_writers * MIN_STAGING_BYTES) - num_spare_staging_bufs;
+
+  // Validation checks
+  if (staging_mem / (num_writers * MIN_STAGING_BYTES) <=
+      num_spare_staging_bufs) {
+    cerr << "Not enough memory for " << num_writers << " writers: "
+         << available_mem << " bytes available" << endl;
+    exit(EXIT_FAILURE);
+  }
+
+  // The size of the stream is unknown, so the number of partitions is fixed,
+  // and the repartitioner splits those that grow too large
+  const int num_partitions =
+      std::clamp<size_t>(STREAM_PARTITIONS, 1, max_fanout);
+
+  const size_t num_staging_bufs =
+      num_partitions + num_spare_staging_bufs; /* per writer */
+  const size_t staging_bytes = std::clamp(
+      internal::_align_down(staging_mem / (num_writers * num_staging_bufs)),
+      MIN_STAGING_BYTES, MAX_STAGING_BYTES);
+
+  // Two batches are in memory at once: one being read and one being routed
+  const size_t read_batch_recs = std::clamp<size_t>(
+      READ_MEM_FRACTION * available_mem / (2 * Layout::BYTES_PER_REC),
+      CONVERT_BATCH_RECS, READ_BATCH_RECS * num_writers);
+
+  //----------------------------------------------------------//
+  //          TRAIN THE MODEL ON THE FIRST CHUNK              //
+  //----------------------------------------------------------//
+
+  internal::LearnedPartitioner partitioner(num_partitions);
+  {
+    const size_t sample_stride =
+        std::max<size_t>(1, first_chunk_recs / TRAINING_SAMPLE_RECS);
+    vector<Embedding> sample;
+    sample.reserve(first_chunk_recs / sample_stride + 1);
+    for (size_t i = 0; i < first_chunk_recs; i += sample_stride) {
+      auto rec = first_chunk + i * Layout::BYTES_PER_REC;
+      sample.emplace_back(
+          rec, internal::_convert_key<Layout>(rec + Layout::KEY_OFFSET));
+    }
+    partitioner.train(sample.data(), sample.data() + sample.size());
+  }
+
+  //----------------------------------------------------------//
+  //              PARTITION THE STREAM ON DISK                //
+  //----------------------------------------------------------//
+
+  // Each writer spills all of its partitions into a single temporary file,
+  // indexed by the extents written for each partition, and routes a slice of
+  // every batch
+  int *spill_fds = new int[num_writers];
+  vector<vector<internal::spill_extent>> spill_extents(num_writers);
+  size_t **fragment_sizes = new size_t *[num_writers];
+  vector<unique_ptr<internal::IOQueue>> ios;
+  vector<unique_ptr<internal::FragmentWriter>> fragment_writers;
+  for (int i = 0; i < num_writers; ++i) {
+    fragment_sizes[i] = new size_t[num_partitions]{0};
+    spill_fds[i] = tmp_roots.open_tmp_file(options.direct_io);
+    ios.emplace_back(new internal::IOQueue(options.io_engine));
+    fragment_writers.emplace_back(new internal::FragmentWriter(
+        spill_fds[i], spill_extents[i], fragment_sizes[i], num_partitions,
+        staging_bytes, *ios[i], options.direct_io));
+  }
+
+  auto route_batch = [&](const char *batch_recs, size_t num_recs) {
+#pragma omp parallel for num_threads(num_writers)
+    for (int writer_idx = 0; writer_idx < num_writers; ++writer_idx) {
+      const size_t slice_begin = num_recs * writer_idx / num_writers;
+      const size_t slice_end = num_recs * (writer_idx + 1) / num_writers;
+
+      // The keys of a block of records are converted at once before routing
+      converted_t converted_keys[CONVERT_BATCH_RECS];
+      for (size_t block_start = slice_begin; block_start < slice_end;
+           block_start += CONVERT_BATCH_RECS) {
+        const size_t block_sz =
+            std::min(CONVERT_BATCH_RECS, slice_end - block_start);
+        const char *block_recs =
+            batch_recs + block_start * Layout::BYTES_PER_REC;
+        utils::_convert_record_keys<Layout>(block_recs, block_sz,
+                                            converted_keys);
+
+        for (size_t i = 0; i < block_sz; ++i) {
+          fragment_writers[writer_idx]->append(
+              partitioner.predict(converted_keys[i]),
+              block_recs + i * Layout::BYTES_PER_REC, Layout::BYTES_PER_REC);
+        }
+      }
+    }
+  };
+
+  // The next batch is read from the source while the current one is routed
+  route_batch(first_chunk, first_chunk_recs);
+  free(first_chunk);
+  char *batch_bufs[2];
+  for (auto &buf : batch_bufs) {
+    buf = internal::_alloc_aligned(read_batch_recs * Layout::BYTES_PER_REC);
+  }
+  auto next_batch =
+      std::async(std::launch::async, read_recs, batch_bufs[0], read_batch_recs);
+  for (int buf_idx = 0;; buf_idx ^= 1) {
+    const size_t num_recs = next_batch.get();
+    if (num_recs == 0) break;
+    if (num_recs == read_batch_recs) {
+      next_batch = std::async(std::launch::async, read_recs,
+                              batch_bufs[buf_idx ^ 1], read_batch_recs);
+    } else {
+      next_batch = std::async(std::launch::deferred, [] { return size_t(0); });
+    }
+    route_batch(batch_bufs[buf_idx], num_recs);
+  }
+  for (auto &buf : batch_bufs) free(buf);
+  for (auto &fragment_writer : fragment_writers) fragment_writer->finish();
+  fragment_writers.clear();
+  ios.clear();
+
+  //----------------------------------------------------------//
+  //            SORT AND EMIT THE PARTITIONS                  //
+  //----------------------------------------------------------//
+
+  // Group the spilled extents by partition, into one fragment per writer
+  vector<internal::spilled_partition> partitions(num_partitions);
+  for (int partition_idx = 0; partition_idx < num_partitions; ++partition_idx) {
+    auto &partition = partitions[partition_idx];
+    for (int writer_idx = 0; writer_idx < num_writers; ++writer_idx) {
+      auto frag_sz = fragment_sizes[writer_idx][partition_idx];
+      if (frag_sz == 0) continue;
+      partition.size += frag_sz;
+      partition.fragments.push_back({spill_fds[writer_idx], frag_sz, {}});
+    }
+  }
+  for (int writer_idx = 0; writer_idx < num_writers; ++writer_idx) {
+    for (auto &extent : spill_extents[writer_idx]) {
+      for (auto &frag : partitions[extent.partition].fragments) {
+        if (frag.fd == spill_fds[writer_idx]) frag.extents.push_back(extent);
+      }
+    }
+    spill_extents[writer_idx].clear();
+    spill_extents[writer_idx].shrink_to_fit();
+  }
+
+  // The first chunk may not represent the rest of the stream, so partitions
+  // can grow past their share of the budget, of which up to
+  // STREAM_PARTITIONS_IN_MEM are held at once while emitting. They are split
+  // on disk before sorting, and the pieces that need no sorting are returned
+  // as in order.
+  const size_t partition_mem_budget =
+      sorter_mem_budget / STREAM_PARTITIONS_IN_MEM;
+  const size_t num_oversized = std::count_if(
+      partitions.begin(), partitions.end(), [&](const auto &partition) {
+        return internal::_partition_mem<Layout>(partition.size) >
+               partition_mem_budget;
+      });
+  const int num_splitters = std::clamp<size_t>(
+      std::min<size_t>(num_oversized, READ_MEM_FRACTION * sorter_mem_budget /
+                                          REPARTITION_BATCH_BYTES),
+      1, num_proc);
+  internal::Repartitioner<Layout> repartitioner(tmp_roots, partition_mem_budget,
+                                                partition_recs, -1, options,
+                                                num_splitters);
+  partitions = repartitioner.split_oversized(partitions);
+
+  auto load_partition = [&](size_t partition_idx) {
+    if (partitions[partition_idx].in_order) return utils::loaded_partition();
+    return utils::_load_partition<Layout>(partitions[partition_idx],
+                                          partition_idx, options);
+  };
+
+  // Emits a sorted partition and frees it. The pieces in order are streamed
+  // straight from the disk.
+  auto emit_partition = [&](utils::loaded_partition partition,
+                            size_t partition_idx) {
+    auto &spilled = partitions[partition_idx];
+    if (spilled.in_order) {
+      internal::IOQueue io(options.io_engine);
+      internal::_for_each_spilled_batch<Layout>(
+          spilled, io, [&](const char *recs, size_t num_recs) {
+            sink(recs, num_recs * Layout::BYTES_PER_REC);
+          });
+      for (auto &frag : spilled.fragments) {
+        for (auto &extent : frag.extents) {
+          utils::_release_file_range(frag.fd, extent.offset, extent.length);
+        }
+      }
+      return;
+    }
+    utils::_emit_recs<Layout>(partition.records, partition.entries,
+                              partition.entries + partition.size, sink);
+    utils::_free_partition(partition);
+  };
+
+  auto next_partition = std::async(std::launch::async, load_partition, 0);
+  std::future<void> prev_emitted;
+  for (size_t partition_idx = 0; partition_idx < partitions.size();
+       ++partition_idx) {
+    auto partition = next_partition.get();
+    if (partition_idx + 1 < partitions.size()) {
+      next_partition =
+          std::async(std::launch::async, load_partition, partition_idx + 1);
+    }
+    internal::in_memory_sort(partition.entries,
+                             partition.entries + partition.size,
+                             partition.size, num_proc);
+    if (prev_emitted.valid()) prev_emitted.get();
+    prev_emitted = std::async(std::launch::async, emit_partition, partition,
+                              partition_idx);
+  }
+  if (prev_emitted.valid()) prev_emitted.get();
+
+  for (int i = 0; i < num_writers; i++) {
+    close(spill_fds[i]);
+    delete[] fragment_sizes[i];
+  }
+  delete[] fragment_sizes;
+  delete[] spill_fds;
+}
+
+/**
+ * @brief Sorts the stream of records read from `in_fd` into `out_fd`, such as
+ * the standard input and output
+ */
+template <class Layout = GensortLayout>
+void sort_stream(int in_fd, int out_fd, const char *tmp_root,
+                 const size_t num_proc, const Options &options = Options()) {
+  sort_stream<Layout>(
+      [in_fd](char *buf, size_t len) {
+        return internal::_read_fully(in_fd, buf, len);
+      },
+      [out_fd](const char *buf, size_t len) {
+        internal::_write_fully(out_fd, buf, len);
+      },
+      tmp_root, num_proc, options);
+}
+}  // namespace elsar
@@ -1,20 +1,112 @@
 #include "elsar/internal/utils.h"
 #include "elsar/sort.h"
+#include "elsar/sort_lines.h"
+#include "elsar/sort_stream.h"
+
+void print_usage(const char* prog) {
+  cout << "USAGE: " << prog
+       << " [in-file] [out-file] optional:[tmp-root],[num-threads]\n"
+       << "  A tmp-root may list several directories, as dir1:dir2\n"
+       << "  A file named - stands for the standard input or output\n"
+       << "OPTIONS:\n"
+       << "  --io-engine=<posix|uring>  I/O backend (default: posix)\n"
+       << "  --direct-io                Bypass the page cache (O_DIRECT)\n"
+       << "  --mmap-input               Partition from the mapped input\n"
+       << "  --global-model             Slice one model for all partitions\n"
+       << "  --save-model=<file>        Save the trained models\n"
+       << "  --load-model=<file>        Reuse models saved by a past run\n"
+       << "  --binary-keys              Sort binary keys (gensort -b)\n"
+       << "  --lines                    Sort newline-delimited records\n"
+       << "  --key-field=<n>            Sort lines by field n (0-based)\n"
+       << "  --delimiter=<c>            Field delimiter (default: tab)\n";
+}
 
 int main(int argc, char* argv[]) {
-  if (argc < 2 or argc > 5) {
-    cout << "USAGE: " << argv[0]
-         << " [in-file] [out-file] optional:[tmp-root],[num-threads]\n";
+  elsar::Options options;
+  bool binary_keys = false;
+  bool lines = false;
+  elsar::LineFormat line_format;
+  vector<char*> args;
+  for (int i = 1; i < argc; ++i) {
+    string arg = argv[i];
+    if (arg.rfind("--", 0) != 0) {
+      args.push_back(argv[i]);
+    } else if (arg == "--io-engine=posix") {
+      options.io_engine = elsar::IOEngine::POSIX;
+    } else if (arg == "--io-engine=uring") {
+      options.io_engine = elsar::IOEngine::IO_URING;
+    } else if (arg == "--direct-io") {
+      options.direct_io = true;
+    } else if (arg == "--mmap-input") {
+      options.mmap_input = true;
+    } else if (arg == "--global-model") {
+      options.global_model = true;
+    } else if (arg.rfind("--save-model=", 0) == 0) {
+      options.save_model_path = argv[i] + strlen("--save-model=");
+    } else if (arg.rfind("--load-model=", 0) == 0) {
+      options.load_model_path = argv[i] + strlen("--load-model=");
+    } else if (arg == "--binary-keys") {
+      binary_keys = true;
+    } else if (arg == "--lines") {
+      lines = true;
+    } else if (arg.rfind("--key-field=", 0) == 0) {
+      lines = true;
+      line_format.key_field = atoi(arg.c_str() + strlen("--key-field="));
+    } else if (arg.rfind("--delimiter=", 0) == 0 and
+               arg.size() == strlen("--delimiter=") + 1) {
+      line_format.delimiter = arg.back();
+    } else {
+      print_usage(argv[0]);
+      exit(-1);
+    }
+  }
+
+  if (args.size() < 2 or args.size() > 4) {
+    print_usage(argv[0]);
     exit(-1);
   }
 
-  auto input_file = argv[1];
-  auto output_file = argv[2];
-  auto tmp_root = argc >= 4 ? argv[3] : ".";
-  auto num_threads = argc == 5 ? atoll(argv[4])
-                               : std::min(thread::hardware_concurrency(),
-                                          elsar::utils::MAX_NUM_PROC);
-  elsar::sort(input_file, output_file, tmp_root, num_threads);
+  auto input_file = args[0];
+  auto output_file = args[1];
+  auto tmp_root = args.size() >= 3 ? args[2] : ".";
+  auto num_threads = args.size() == 4 ? atoll(args[3])
+                                      : std::min(thread::hardware_concurrency(),
+                                                 elsar::utils::MAX_NUM_PROC);
+  const bool stream = strcmp(input_file, "-") == 0 or
+                      strcmp(output_file, "-") == 0;
+  if (stream and lines) {
+    cerr << "ERROR: Lines cannot be sorted from or to a stream" << endl;
+    exit(-1);
+  }
+
+  if (stream) {
+    int in_fd = strcmp(input_file, "-") == 0
+                    ? STDIN_FILENO
+                    : elsar::utils::_open_input_or_fail(input_file);
+    int out_fd = strcmp(output_file, "-") == 0
+                     ? STDOUT_FILENO
+                     : open(output_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out_fd < 0) {
+      cerr << "ERROR: Could not open file:" << output_file << endl;
+      exit(-1);
+    }
+    if (binary_keys) {
+      elsar::sort_stream<elsar::BinaryGensortLayout>(in_fd, out_fd, tmp_root,
+                                                     num_threads, options);
+    } else {
+      elsar::sort_stream(in_fd, out_fd, tmp_root, num_threads, options);
+    }
+    if (in_fd != STDIN_FILENO) close(in_fd);
+    if (out_fd != STDOUT_FILENO) close(out_fd);
+  } else if (lines) {
+    elsar::sort_lines(input_file, output_file, tmp_root, num_threads,
+                      line_format, options);
+  } else if (binary_keys) {
+    elsar::sort<elsar::BinaryGensortLayout>(input_file, output_file, tmp_root,
+                                            num_threads, options);
+  } else {
+    elsar::sort(input_file, output_file, tmp_root, num_threads, options);
+  }
 
   return 0;
 }